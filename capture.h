@@ -0,0 +1,25 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// binary capture of every hid report cp2112.c sends and receives
+// written with --record=file, played back by the replay backend (make replay)
+//
+// the file starts with CAPTURE_MAGIC, then one record per hidapi call:
+//     CAPTURE_HEADER_LEN bytes, little-endian
+//         u64 ns since the capture started
+//         u8  kind (enum capture_kind)
+//         u8  link, the adapter in the order they were opened
+//         u16 len of the data that follows
+//         i32 result, what the hidapi call returned
+//     len bytes of data
+// writes and sent feature reports carry what was sent,
+// reads and fetched feature reports carry what came back,
+// CAPTURE_OPEN carries the adapter's serial number
+
+#define CAPTURE_MAGIC "MLXHID1\n"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_HEADER_LEN 16
+
+enum capture_kind {CAPTURE_OPEN = 1, CAPTURE_WRITE, CAPTURE_READ, CAPTURE_SEND_FEATURE, CAPTURE_GET_FEATURE};
+
+#endif /* CAPTURE_H */
@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef _WIN32
     #include <windows.h>
     #include <direct.h>
@@ -10,6 +13,270 @@
 
 #include <hidapi.h>
 #include "cp2112.h"
+#include "stats.h"
+#include "tick.h"
+#include "capture.h"
+
+// settings and counters for each open CP2112, found by handle
+// entries are only added (from setup, before any acquisition threads) so lookups don't lock
+struct cp2112_link
+{
+    hid_device *handle;
+    int speed;  // the smbus clock from the last setup_i2c(), used to predict transfer times
+    int autosend;  // when set the CP2112 pushes read data without a DATA_READ_FORCE
+    char serial[32];
+    struct cp2112_poll_stats polls;
+    int failed;  // a transfer went wrong since the last cancel_transfer()
+    long generation;  // bumped whenever chip state may have changed behind the shadow maps
+    // only written by the thread doing i/o on the handle
+    struct cp2112_counters counters;
+    struct latency_histogram latency[LATENCY_TYPES];
+    struct latency_histogram *by_address[I2C_ADDRESSES];  // allocated on first use
+};
+
+static const char latency_names[LATENCY_TYPES][12] = {"write", "write-read", "read", "status"};
+
+static struct cp2112_link links[CP2112_MAX_LINKS];
+static struct cp2112_link spare_link = {NULL, I2C_NORMAL_SPEED, 0};
+static pthread_mutex_t links_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cp2112_link *link_for(hid_device *handle)
+{
+    int i;
+    struct cp2112_link *link = &spare_link;
+    for (i=0; i<CP2112_MAX_LINKS; i++) {
+        if (links[i].handle == handle) {
+            return &links[i];
+        }
+    }
+    pthread_mutex_lock(&links_lock);
+    for (i=0; i<CP2112_MAX_LINKS; i++) {
+        if (links[i].handle == handle) {
+            link = &links[i];
+            break;
+        }
+        if (links[i].handle == NULL) {
+            memset(&links[i], 0, sizeof(links[i]));
+            links[i].speed = I2C_NORMAL_SPEED;
+            links[i].handle = handle;
+            link = &links[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&links_lock);
+    return link;
+}
+
+// --record: every report that goes through the wrappers below ends up in here
+static FILE *capture_file;
+static struct timespec capture_start;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int cp2112_capture(const char *path)
+{
+    // call before any adapter is opened
+    capture_file = fopen(path, "wb");
+    if (capture_file == NULL) {
+        return -1;
+    }
+    tick_now(&capture_start);
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capture_file);
+    return 0;
+}
+
+void cp2112_capture_stop(void)
+{
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+static void capture(hid_device *handle, int kind, const unsigned char *data, int len, int result)
+{
+    unsigned char head[CAPTURE_HEADER_LEN];
+    struct timespec now;
+    unsigned long long ns;
+    int i, link;
+    if (capture_file == NULL) {
+        return;
+    }
+    tick_now(&now);
+    ns = (unsigned long long)(now.tv_sec - capture_start.tv_sec) * 1000000000ULL + now.tv_nsec - capture_start.tv_nsec;
+    link = link_for(handle) - links;
+    if (len < 0) {
+        len = 0;
+    }
+    for (i=0; i<8; i++) {
+        head[i] = (ns >> (8 * i)) & 0xFF;
+    }
+    head[8] = kind;
+    head[9] = link;
+    head[10] = len & 0xFF;
+    head[11] = (len >> 8) & 0xFF;
+    for (i=0; i<4; i++) {
+        head[12 + i] = ((unsigned int)result >> (8 * i)) & 0xFF;
+    }
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file) {
+        fwrite(head, 1, sizeof(head), capture_file);
+        fwrite(data, 1, len, capture_file);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void cp2112_name(hid_device *handle, const char *serial)
+{
+    // for the capture, so a replay can list the same adapters
+    struct cp2112_link *link = link_for(handle);
+    snprintf(link->serial, sizeof(link->serial), "%s", serial);
+    capture(handle, CAPTURE_OPEN, (const unsigned char *)link->serial, strlen(link->serial), 0);
+}
+
+// all hid traffic goes through these
+static int usb_write(hid_device *handle, const unsigned char *data, size_t length)
+{
+    int res = hid_write(handle, data, length);
+    capture(handle, CAPTURE_WRITE, data, length, res);
+    return res;
+}
+
+static int usb_read_timeout(hid_device *handle, unsigned char *data, size_t length, int milliseconds)
+{
+    int res = hid_read_timeout(handle, data, length, milliseconds);
+    capture(handle, CAPTURE_READ, data, res, res);
+    return res;
+}
+
+static int usb_read(hid_device *handle, unsigned char *data, size_t length)
+{
+    int res = hid_read(handle, data, length);
+    capture(handle, CAPTURE_READ, data, res, res);
+    return res;
+}
+
+static int usb_send_feature(hid_device *handle, const unsigned char *data, size_t length)
+{
+    int res = hid_send_feature_report(handle, data, length);
+    capture(handle, CAPTURE_SEND_FEATURE, data, length, res);
+    return res;
+}
+
+static int usb_get_feature(hid_device *handle, unsigned char *data, size_t length)
+{
+    int res = hid_get_feature_report(handle, data, length);
+    capture(handle, CAPTURE_GET_FEATURE, data, res < 0 ? 1 : res, res);
+    return res;
+}
+
+struct cp2112_poll_stats *i2c_polls(hid_device *handle)
+{
+    return &link_for(handle)->polls;
+}
+
+static void count_polls(hid_device *handle, int polls)
+{
+    struct cp2112_poll_stats *stats = i2c_polls(handle);
+    stats->last = polls;
+    stats->total += polls;
+    stats->transactions++;
+}
+
+struct cp2112_counters *i2c_counters(hid_device *handle)
+{
+    return &link_for(handle)->counters;
+}
+
+void i2c_count_retry(hid_device *handle)
+{
+    link_for(handle)->counters.retries++;
+}
+
+static long now_us(void)
+{
+    struct timespec ts;
+    tick_now(&ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+static void count_failure(hid_device *handle, struct cp2112_status_reply *status)
+{
+    // sorts a BUS_ERROR status by its cause
+    struct cp2112_counters *counters = i2c_counters(handle);
+    counters->retries += status->retries;
+    if (status->mode != BUS_ERROR) {
+        return;
+    }
+    switch (status->message) {
+        case I2C_TIMEOUT_NACK:
+            counters->nacks++;
+            break;
+        case I2C_TIMEOUT_NF:
+            counters->timeouts++;
+            break;
+        default:
+            counters->errors++;
+            break;
+    }
+}
+
+static void record_xfer(hid_device *handle, int type, int address, long us)
+{
+    struct cp2112_link *link = link_for(handle);
+    record_latency(&link->latency[type], us);
+    if (address < 0 || address >= I2C_ADDRESSES) {
+        return;
+    }
+    if (link->by_address[address] == NULL) {
+        link->by_address[address] = calloc(1, sizeof(struct latency_histogram));
+        if (link->by_address[address] == NULL) {
+            return;
+        }
+    }
+    record_latency(link->by_address[address], us);
+}
+
+int i2c_dump_latency(hid_device *handle, const char *name, FILE *f)
+{
+    // call from the thread doing i/o on the handle, or once it has stopped
+    struct cp2112_link *link = link_for(handle);
+    struct cp2112_counters *c = &link->counters;
+    int i;
+    fprintf(f, "%s: %li transfers, %li status polls, %li nacks, %li retries, %li timeouts, %li other errors, %li writes skipped\n",
+        name, c->transfers, c->polls, c->nacks, c->retries, c->timeouts, c->errors, c->skipped);
+    fprintf(f, "%-12s %8s %8s %8s %8s %8s %8s %8s  (us)\n", "", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (i=0; i<LATENCY_TYPES; i++) {
+        fprintf(f, "%-12s ", latency_names[i]);
+        latency_summary(&link->latency[i], f);
+        fprintf(f, "\n");
+    }
+    for (i=0; i<I2C_ADDRESSES; i++) {
+        if (link->by_address[i] == NULL) {
+            continue;
+        }
+        fprintf(f, "0x%-10X ", i);
+        latency_summary(link->by_address[i], f);
+        fprintf(f, "\n");
+    }
+    return 0;
+}
+
+void i2c_clear_latency(hid_device *handle)
+{
+    struct cp2112_link *link = link_for(handle);
+    int i;
+    memset(&link->counters, 0, sizeof(link->counters));
+    for (i=0; i<LATENCY_TYPES; i++) {
+        clear_latency(&link->latency[i]);
+    }
+    for (i=0; i<I2C_ADDRESSES; i++) {
+        if (link->by_address[i]) {
+            clear_latency(link->by_address[i]);
+        }
+    }
+}
 
 int dump_buffer(unsigned char *buf, int len)
 {
@@ -26,7 +293,35 @@ int cancel_transfer(hid_device *handle)
     unsigned char buf[5];
     buf[0] = CANCEL_TRANSFER;
     buf[1] = 0x01;
-    return hid_send_feature_report(handle, buf, 2);
+    link_for(handle)->failed = 0;
+    return usb_send_feature(handle, buf, 2);
+}
+
+long i2c_generation(hid_device *handle)
+{
+    return link_for(handle)->generation;
+}
+
+void i2c_invalidate(hid_device *handle)
+{
+    // every register shadowed on this link is unknown again
+    link_for(handle)->generation++;
+}
+
+static void link_failed(hid_device *handle)
+{
+    struct cp2112_link *link = link_for(handle);
+    link->failed = 1;
+    link->generation++;
+}
+
+int i2c_recover(hid_device *handle)
+{
+    // cancel_transfer() only when something went wrong, a healthy link skips the usb round trip
+    if (!link_for(handle)->failed) {
+        return 0;
+    }
+    return cancel_transfer(handle);
 }
 
 int setup_gpio(hid_device *handle, int use_leds)
@@ -43,19 +338,20 @@ int setup_gpio(hid_device *handle, int use_leds)
         buf[3] = 0x00;
     }
     buf[4] = 0x00;
-    return hid_send_feature_report(handle, buf, 5);
+    return usb_send_feature(handle, buf, 5);
 }
 
 int setup_i2c(hid_device *handle, int speed)
 {
     unsigned char buf[20];
+    int res;
     buf[0] = SMBUS_CONFIG;
     buf[1] = (speed >> 24) & 0xFF;
     buf[2] = (speed >> 16) & 0xFF;
     buf[3] = (speed >>  8) & 0xFF;
     buf[4] = (speed)       & 0xFF;
     buf[5] = 0x02;  // self address
-    buf[6] = 0x00;  // autosend
+    buf[6] = link_for(handle)->autosend ? 0x01 : 0x00;
     buf[7]  = (I2C_W_TIMEOUT >> 8) & 0xFF;
     buf[8]  = (I2C_W_TIMEOUT)      & 0xFF;
     buf[9]  = (I2C_R_TIMEOUT >> 8) & 0xFF;
@@ -63,7 +359,30 @@ int setup_i2c(hid_device *handle, int speed)
     buf[11] = (I2C_LOW_TIMOUT);
     buf[12] = (I2C_ATTEMPTS  >> 8) & 0xFF;
     buf[13] = (I2C_ATTEMPTS)       & 0xFF;
-    return hid_send_feature_report(handle, buf, 14);
+    res = usb_send_feature(handle, buf, 14);
+    if (res >= 0) {
+        link_for(handle)->speed = speed;
+    }
+    return res;
+}
+
+int setup_autosend(hid_device *handle, int enable)
+{
+    // re-sends the smbus config, reverts to forced reads if the device refuses
+    int res;
+    struct cp2112_link *link = link_for(handle);
+    link->autosend = enable;
+    res = setup_i2c(handle, link->speed);
+    if (res < 0) {
+        link->autosend = 0;
+    }
+    return res;
+}
+
+int i2c_speed(hid_device *handle)
+{
+    // the smbus clock the CP2112 was last set to
+    return link_for(handle)->speed;
 }
 
 int get_gpio(hid_device *handle)
@@ -72,7 +391,7 @@ int get_gpio(hid_device *handle)
     int res;
     buf[0] = GET_GPIO;
     buf[1] = 2;
-    res = hid_get_feature_report(handle, buf, 2);
+    res = usb_get_feature(handle, buf, 2);
     if (res < 0) {
         return res;
     }
@@ -88,45 +407,77 @@ int set_gpio(hid_device *handle, int values, int bitmask)
     buf[0] = SET_GPIO;
     buf[1] = values;
     buf[2] = bitmask;
-    return hid_send_feature_report(handle, buf, 3);
+    return usb_send_feature(handle, buf, 3);
     // probably should be smarter about types
     // see if this works with hid_write() for stability
 }
 
-char crc_naive(char *buf, int len)
+// crc-8 with CRC_POLYNOMIAL, one byte per lookup
+static const unsigned char crc8_table[256] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+    0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+    0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+    0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+    0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+    0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+    0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+    0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+    0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+    0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+    0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+};
+
+unsigned char smbus_pec(const unsigned char *buf, int len, unsigned char crc)
 {
-    int i, bit;
-    char res = 0;
+    // pass 0 to start, or a previous result to continue
+    int i;
     for (i=0; i<len; i++) {
-        res ^= (buf[i] << (CRC_WIDTH - 8));
-        for (bit=8; bit>0; bit--) {
-            if (res & CRC_MSB) { 
-                res = (res << 1) ^ CRC_POLYNOMIAL;
-            } else {
-                res = (res << 1);
-            }
-        }
+        crc = crc8_table[crc ^ buf[i]];
     }
-    return res;
+    return crc;
+}
+
+int i2c_check_pec(int address, int reg, unsigned char *data, int len)
+{
+    // data is the reply of a write-read with the PEC as its last byte
+    // the PEC covers both address bytes and the command too
+    unsigned char head[3];
+    unsigned char crc;
+    if (len < 2) {
+        return false;
+    }
+    head[0] = address << 1;
+    head[1] = reg;
+    head[2] = (address << 1) | 1;
+    crc = smbus_pec(head, 3, 0);
+    crc = smbus_pec(data, len - 1, crc);
+    return crc == data[len - 1];
 }
 
 int i2c_status(hid_device *handle, struct cp2112_status_reply *status)
 {
     unsigned char buf[30];
     int res;
+    long start = now_us();
     status->mode = BUS_UNKNOWN;
     status->message = I2C_UNKNOWN;
     status->retries = 0;
     status->length = 0;
     buf[0] = XFER_STATUS_REQ;
     buf[1] = 0x01;
-    res = hid_write(handle, buf, 2);
+    res = usb_write(handle, buf, 2);
     //res = hid_send_feature_report(handle, buf, 2);
     if (res < 0) {
         return res;
     }
     memset(buf, 0, sizeof(buf));
-    res = hid_read(handle, buf, 7);
+    res = usb_read(handle, buf, 7);
+    record_latency(&link_for(handle)->latency[LATENCY_STATUS], now_us() - start);
     // not sure why a READ_RESPONSE comes back sometimes
     if (buf[0] != XFER_STATUS_RESPONSE) {
         return -1;
@@ -145,119 +496,449 @@ int i2c_status(hid_device *handle, struct cp2112_status_reply *status)
     return 0;
 }
 
-int i2c_write(hid_device *handle, int address, unsigned char *data, int len)
+long i2c_transfer_us(hid_device *handle, int bytes)
 {
-    unsigned char buf[100];
-    int res;
+    // time on the wire for 'bytes' bytes (address bytes included)
+    return i2c_wire_us(link_for(handle)->speed, bytes);
+}
+
+long i2c_wire_us(int speed, int bytes)
+{
+    // 9 clocks per byte with the ack, plus a few for start/stop
+    return (long)(bytes * 9 + 3) * 1000000L / (long)speed;
+}
+
+long i2c_round_trip_us(hid_device *handle)
+{
+    // a status request never touches the bus, so it times the usb alone
+    // returns -1 when the link doesn't answer
     struct cp2112_status_reply status;
-    if (len > 95) {
-        return -1;
-    }
-    buf[0] = DATA_WRITE;
-    buf[1] = address << 1;
-    buf[2] = len;
-    memcpy(buf+3, data, len);
-    res = hid_write(handle, buf, len+3);
-    //return res;
-    do {
-        res = i2c_status(handle, &status);
-        if (res < 0) {
-            return res;
+    long us[I2C_ROUND_TRIPS], t, start;
+    int i, j;
+    for (i=0; i<I2C_ROUND_TRIPS; i++) {
+        start = now_us();
+        if (i2c_status(handle, &status) < 0) {
+            return -1;
         }
-    } while(status.message == I2C_WR_INPROGRESS);
-    return status.message != I2C_SUCCESS;
+        t = now_us() - start;
+        for (j=i; j>0 && us[j-1]>t; j--) {
+            us[j] = us[j-1];
+        }
+        us[j] = t;
+    }
+    return us[I2C_ROUND_TRIPS / 2];
 }
 
-int i2c_wait(hid_device *handle)
+void i2c_cost_read(struct i2c_cost *cost, int len)
 {
-    struct cp2112_status_reply status;
-    int res;
-    do {
-        res = i2c_status(handle, &status);
+    // a register read of len bytes, counted like build_read()
+    cost->reads++;
+    cost->wire += 3 + len;
+}
+
+void i2c_cost_write(struct i2c_cost *cost, int len)
+{
+    // len includes the register byte, counted like build_write()
+    cost->writes++;
+    cost->wire += 1 + len;
+}
+
+long i2c_cost_us(hid_device *handle, struct i2c_cost *cost, int speed, long round_trip_us)
+{
+    // predicted time the link is busy with one read at the given clock
+    // every transfer waits for one reply, and without autosend a read also needs its DATA_READ_FORCE
+    int transfers = cost->reads + cost->writes;
+    int trips = transfers;
+    if (!link_for(handle)->autosend) {
+        trips += cost->reads;
+    }
+    if (transfers == 0) {
+        return 0;
+    }
+    return trips * round_trip_us + i2c_wire_us(speed, cost->wire) + (transfers - 1) * i2c_wire_us(speed, 0);
+}
+
+int i2c_poll(hid_device *handle, struct cp2112_status_reply *status, int bytes)
+{
+    // waits for the transfer in progress to leave BUS_BUSY
+    // sleeps through the predicted transfer time and then polls with a doubling backoff
+    long wait_us, slept_us;
+    int res, polls;
+    polls = 0;
+    slept_us = 0;
+    wait_us = i2c_transfer_us(handle, bytes) - I2C_POLL_MIN_US;
+    if (wait_us > 0) {
+        tick_sleep_us(wait_us);
+        slept_us += wait_us;
+    }
+    wait_us = I2C_POLL_MIN_US;
+    while (1) {
+        res = i2c_status(handle, status);
+        polls++;
         if (res < 0) {
-            return res;
+            break;
+        }
+        if (status->mode != BUS_BUSY) {
+            break;
+        }
+        if (slept_us > I2C_POLL_TIMEOUT_US) {
+            i2c_counters(handle)->timeouts++;
+            res = -1;
+            break;
+        }
+        tick_sleep_us(wait_us);
+        slept_us += wait_us;
+        wait_us *= 2;
+        if (wait_us > I2C_POLL_MAX_US) {
+            wait_us = I2C_POLL_MAX_US;
         }
-    } while (status.mode == BUS_BUSY);
-    if (status.mode == BUS_IDLE) {
-        return 0;
     }
-    return (status.message != I2C_SUCCESS);
+    count_polls(handle, polls);
+    i2c_counters(handle)->polls += polls;
+    if (res >= 0) {
+        count_failure(handle, status);
+    }
+    return res;
 }
 
-int read_word(hid_device *handle, int address, int reg, int reply_length)
+static int build_write(struct i2c_xfer *xfer, int address, unsigned char *data, int len)
 {
-    // performs a write-read that has been stripped down to the bare minimum for these sensors
-    // setting reg to -1 will disable the register request
-    unsigned char buf[10];
-    struct cp2112_status_reply status;
-    int res;
+    // encodes a DATA_WRITE report, nothing is sent yet
+    if (len < 1 || len > CP2112_WRITE_PAYLOAD) {
+        return -1;
+    }
+    xfer->type = XFER_WRITE;
+    xfer->address = address;
+    xfer->data = NULL;
+    xfer->read_len = 0;
+    xfer->wire = len + 1;
+    xfer->report[0] = DATA_WRITE;
+    xfer->report[1] = address << 1;
+    xfer->report[2] = len;
+    memcpy(xfer->report+3, data, len);
+    xfer->report_len = len + 3;
+    xfer->probe = 0;
+    xfer->result = -1;
+    xfer->polls = 0;
+    return 0;
+}
+
+static int build_read(struct i2c_xfer *xfer, int address, int reg, unsigned char *data, int len)
+{
+    // encodes a DATA_WRITE_READ report, or a DATA_READ when reg is NO_REGISTER
+    unsigned char *buf = xfer->report;
+    if (len < 1 || len > CP2112_MAX_TRANSFER) {
+        return -1;
+    }
+    xfer->address = address;
+    xfer->data = data;
+    xfer->read_len = len;
+    xfer->slack_ms = I2C_AUTOSEND_SLACK_MS;
+    xfer->probe = 0;
     buf[0] = DATA_WRITE_READ;
     buf[1] = address << 1;
-    buf[2] = 0;  // reply length high byte
-    buf[3] = reply_length & 0xFF;
+    buf[2] = (len >> 8) & 0xFF;  // reply length high byte
+    buf[3] = len & 0xFF;
     if (reg >= 0) {
+        xfer->type = XFER_WRITE_READ;
         buf[4] = 1;  // send length
         buf[5] = reg & 0xFF;  // payload
-        res = hid_write(handle, buf, 6);
+        xfer->report_len = 6;
+        xfer->wire = 3 + len;
     } else {
+        xfer->type = XFER_READ;
         buf[0] = DATA_READ;
         buf[4] = 0;
         buf[5] = 0;
-        res = hid_write(handle, buf, 5);
-    }
-    if (res < 0) {
-        return res;
+        xfer->report_len = 5;
+        xfer->wire = 1 + len;
     }
+    xfer->result = -1;
+    xfer->polls = 0;
+    return 0;
+}
 
-    while (1) {
-        res = i2c_status(handle, &status);
+static int read_autosend(hid_device *handle, struct i2c_xfer *xfer)
+{
+    // the CP2112 sends DATA_READ_RESPONSE reports on its own as soon as the read completes
+    // status is only requested when nothing shows up, so that a nack doesn't sit out the timeout
+    // one status request is out at a time, and a busy reply backs off like i2c_poll()
+    // both kinds of report can arrive in either order, so they are sorted out here
+    unsigned char buf[CP2112_REPORT_SIZE];
+    struct cp2112_status_reply status;
+    int res, got, polls, pending, wait_ms;
+    long waited_us, backoff_us;
+    int counted = 0;
+    int len = xfer->read_len;
+    got = 0;
+    polls = 0;
+    pending = 0;
+    waited_us = 0;
+    backoff_us = I2C_POLL_MIN_US;
+    wait_ms = xfer->slack_ms + (int)(i2c_transfer_us(handle, xfer->wire) / 1000L);
+    res = 0;
+    while (got < len) {
+        res = usb_read_timeout(handle, buf, sizeof(buf), wait_ms);
         if (res < 0) {
-            return res;
+            break;
+        }
+        if (res == 0) {
+            waited_us += wait_ms * 1000L;
+            if (waited_us > I2C_R_TIMEOUT * 1000L) {
+                cancel_transfer(handle);
+                i2c_counters(handle)->timeouts++;
+                res = -1;
+                break;
+            }
+            if (!pending) {
+                buf[0] = XFER_STATUS_REQ;
+                buf[1] = 0x01;
+                res = usb_write(handle, buf, 2);
+                if (res < 0) {
+                    break;
+                }
+                polls++;
+                pending = 1;
+            }
+            // until the reply or the data turns up
+            wait_ms = 1;
+            continue;
+        }
+        if (buf[0] == XFER_STATUS_RESPONSE) {
+            if (!pending) {
+                // left over from an earlier transfer
+                continue;
+            }
+            pending = 0;
+            if (buf[1] == BUS_ERROR) {
+                status.mode = buf[1];
+                status.message = buf[2];
+                status.retries = (buf[3] << 8) | buf[4];
+                count_failure(handle, &status);
+                counted = 1;
+                res = -1;
+                break;
+            }
+            if (buf[1] != BUS_BUSY) {
+                // done, the data is on its way and only the timeout is left to watch
+                wait_ms = I2C_R_TIMEOUT - (int)(waited_us / 1000L);
+                if (wait_ms < 0) {
+                    wait_ms = 0;
+                }
+                continue;
+            }
+            tick_sleep_us(backoff_us);
+            waited_us += backoff_us;
+            backoff_us *= 2;
+            if (backoff_us > I2C_POLL_MAX_US) {
+                backoff_us = I2C_POLL_MAX_US;
+            }
+            // whatever came in meanwhile is picked up before asking again
+            wait_ms = 0;
+            continue;
         }
-        if (status.mode == BUS_BUSY) {
-            usleep(1000);
+        if (buf[0] != DATA_READ_RESPONSE) {
             continue;
         }
-        if (status.mode == BUS_GOOD) {
+        if (buf[1] == BUS_ERROR || buf[2] > len - got) {
+            // the data report doesn't say why, assume the usual
+            if (buf[1] == BUS_ERROR) {
+                i2c_counters(handle)->nacks++;
+                counted = 1;
+            }
+            res = -1;
             break;
         }
+        memcpy(xfer->data + got, buf + 3, buf[2]);
+        got += buf[2];
+    }
+    // don't leave a status reply behind for the next transaction
+    while (pending && usb_read_timeout(handle, buf, sizeof(buf), I2C_DRAIN_MS) > 0) {
+        if (buf[0] == XFER_STATUS_RESPONSE) {
+            pending = 0;
+        }
+    }
+    xfer->polls = polls;
+    count_polls(handle, polls);
+    i2c_counters(handle)->polls += polls;
+    if (res < 0) {
+        if (!counted) {
+            i2c_counters(handle)->errors++;
+        }
+        return res;
+    }
+    return got;
+}
+
+static int read_forced(hid_device *handle, struct i2c_xfer *xfer)
+{
+    // fallback for when autosend is off
+    unsigned char buf[CP2112_REPORT_SIZE];
+    struct cp2112_status_reply status;
+    int res, got, chunk;
+    int len = xfer->read_len;
+    res = i2c_poll(handle, &status, xfer->wire);
+    xfer->polls = i2c_polls(handle)->last;
+    if (res < 0) {
+        return res;
+    }
+    if (status.mode != BUS_GOOD) {
         return -1;
     }
-    if (status.length < reply_length) {
+    if (status.length < len) {
         return -1;
     }
 
-    memset(buf, 0, sizeof(buf));
-    buf[0] = DATA_READ_FORCE;
-    buf[1] = 0x00;
-    buf[2] = reply_length & 0xFF;
-    res = hid_write(handle, buf, 3);
+    // one force per report, same as the linux hid-cp2112 driver
+    got = 0;
+    while (got < len) {
+        chunk = len - got;
+        if (chunk > CP2112_READ_PAYLOAD) {
+            chunk = CP2112_READ_PAYLOAD;
+        }
+        memset(buf, 0, sizeof(buf));
+        buf[0] = DATA_READ_FORCE;
+        buf[1] = (chunk >> 8) & 0xFF;
+        buf[2] = chunk & 0xFF;
+        res = usb_write(handle, buf, 3);
+        if (res < 0) {
+            return res;
+        }
+        res = usb_read(handle, buf, sizeof(buf));
+        if (res < 0) {
+            return res;
+        }
+        if (buf[0] != DATA_READ_RESPONSE || buf[1] == BUS_ERROR) {
+            return -1;
+        }
+        if (buf[2] == 0 || buf[2] > chunk) {
+            return -1;
+        }
+        memcpy(xfer->data + got, buf + 3, buf[2]);
+        got += buf[2];
+    }
+    return got;
+}
+
+static int xfer_run(hid_device *handle, struct i2c_xfer *xfer)
+{
+    // sends one encoded transfer and waits it out
+    // the CP2112 runs one smbus transfer at a time and ignores requests while it is busy,
+    // so there is nothing to gain from having the next report on its way any earlier
+    // writes give 0 on success and 1 on a bus error, reads give the byte count
+    struct cp2112_status_reply status;
+    int res;
+    long start = now_us();
+    long nacks = i2c_counters(handle)->nacks;
+    i2c_counters(handle)->transfers++;
+    res = usb_write(handle, xfer->report, xfer->report_len);
     if (res < 0) {
+        i2c_counters(handle)->errors++;
+        link_failed(handle);
+        xfer->result = res;
         return res;
     }
+    if (xfer->type == XFER_WRITE) {
+        res = i2c_poll(handle, &status, xfer->wire);
+        xfer->polls = i2c_polls(handle)->last;
+        if (res >= 0) {
+            res = status.message != I2C_SUCCESS;
+        }
+    } else if (link_for(handle)->autosend) {
+        res = read_autosend(handle, xfer);
+    } else {
+        res = read_forced(handle, xfer);
+    }
+    xfer->result = res;
+    record_xfer(handle, xfer->type, xfer->address, now_us() - start);
+    // a probe that nothing acked left every chip on the link as it was
+    if (xfer->probe && i2c_counters(handle)->nacks > nacks) {
+        return res;
+    }
+    if (res < 0 || (xfer->type == XFER_WRITE && res)) {
+        link_failed(handle);
+    }
+    return res;
+}
+
+int i2c_write(hid_device *handle, int address, unsigned char *data, int len)
+{
+    struct i2c_xfer xfer;
+    if (build_write(&xfer, address, data, len)) {
+        return -1;
+    }
+    return xfer_run(handle, &xfer);
+}
 
-    res = hid_read(handle, buf, reply_length+3);
+int i2c_wait(hid_device *handle)
+{
+    struct cp2112_status_reply status;
+    int res;
+    res = i2c_poll(handle, &status, 0);
     if (res < 0) {
         return res;
     }
-    if (buf[0] == DATA_READ_RESPONSE && buf[2] != reply_length) {
+    if (status.mode == BUS_IDLE) {
+        return 0;
+    }
+    return (status.message != I2C_SUCCESS);
+}
+
+int i2c_read_block(hid_device *handle, int address, int reg, unsigned char *data, int len)
+{
+    // a write-read of up to 512 bytes, returns the number of bytes read
+    // setting reg to -1 will disable the register request
+    // the reply comes back in as many DATA_READ_RESPONSE reports as it takes
+    struct i2c_xfer xfer;
+    if (build_read(&xfer, address, reg, data, len)) {
+        return -1;
+    }
+    return xfer_run(handle, &xfer);
+}
+
+int read_word(hid_device *handle, int address, int reg, int reply_length)
+{
+    // little-endian wrapper around i2c_read_block() for the 1 to 3 byte registers of these sensors
+    unsigned char buf[3];
+    int res, i, word;
+    if (reply_length < 1 || reply_length > 3) {
         return -1;
     }
-    if (buf[2] == 1) {
-        return buf[3];
+    res = i2c_read_block(handle, address, reg, buf, reply_length);
+    if (res < 0) {
+        return res;
+    }
+    if (res != reply_length) {
+        return -1;
     }
-    if (buf[2] == 2) {
-        return (buf[4]<<8) + buf[3];
+    word = 0;
+    for (i=reply_length-1; i>=0; i--) {
+        word = (word << 8) | buf[i];
     }
-    if (buf[2] == 3) {
-        return (buf[5]<<16) + (buf[4]<<8) + buf[3];
+    return word;
+}
+
+void cp2112_forget(hid_device *handle)
+{
+    // call before closing a handle so a new one can't inherit its settings
+    int i, a;
+    pthread_mutex_lock(&links_lock);
+    for (i=0; i<CP2112_MAX_LINKS; i++) {
+        if (links[i].handle == handle) {
+            for (a=0; a<I2C_ADDRESSES; a++) {
+                free(links[i].by_address[a]);
+            }
+            links[i].handle = NULL;
+        }
     }
-    return -1;
+    pthread_mutex_unlock(&links_lock);
 }
 
 int cleanup(hid_device *handle)
 {
+    cp2112_forget(handle);
     hid_close(handle);
+    cp2112_capture_stop();
     hid_exit();
 #ifdef _WIN32
     system("pause");
@@ -265,6 +946,20 @@ int cleanup(hid_device *handle)
     return 0;
 }
 
+int i2c_ack(hid_device *handle, int address)
+{
+    // whether anything answers at the address, with the shortest transfer the CP2112 has
+    // there is no zero length transfer so this reads one byte, which no register pointer notices
+    struct i2c_xfer xfer;
+    unsigned char buf[1];
+    if (build_read(&xfer, address, NO_REGISTER, buf, 1)) {
+        return false;
+    }
+    xfer.slack_ms = I2C_ACK_SLACK_MS;
+    xfer.probe = 1;
+    return xfer_run(handle, &xfer) == 1;
+}
+
 int has_address(int address, const int address_list[])
 {
     int i;
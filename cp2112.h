@@ -2,6 +2,7 @@
 #define CP2112_H
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <hidapi.h>
 
 #define CP2112_VID 0x10C4
@@ -25,6 +26,58 @@ struct cp2112_status_reply {
     int length;
 };
 
+struct cp2112_poll_stats {
+    int last;  // status polls used by the most recent transaction
+    long total;
+    long transactions;
+};
+
+// one per open adapter
+#define CP2112_MAX_LINKS 8
+
+#define CP2112_REPORT_SIZE 64
+#define CP2112_READ_PAYLOAD 61
+#define CP2112_WRITE_PAYLOAD 61
+#define CP2112_MAX_TRANSFER 512
+
+enum i2c_xfer_type {XFER_WRITE, XFER_WRITE_READ, XFER_READ};
+// latency is kept for each transfer type plus status polls
+#define LATENCY_STATUS (XFER_READ + 1)
+#define LATENCY_TYPES (LATENCY_STATUS + 1)
+#define I2C_ADDRESSES 128
+
+struct cp2112_counters {
+    long transfers;
+    long polls;
+    long nacks;
+    long retries;  // reported by the CP2112 plus any counted with i2c_count_retry()
+    long timeouts;
+    long errors;  // every other failure
+    long skipped;  // register writes the shadow maps knew were not needed
+};
+
+struct i2c_xfer {
+    enum i2c_xfer_type type;
+    int address;
+    unsigned char report[CP2112_REPORT_SIZE];  // encoded before anything is sent
+    int report_len;
+    int wire;  // bytes on the bus, for timing
+    unsigned char *data;  // where read data goes
+    int read_len;
+    int slack_ms;  // how long autosend is given before the status is asked for
+    int probe;  // nobody answering is an expected result and not a link failure
+    int result;  // bytes read, or 0/1 for a write, negative on failure
+    int polls;
+};
+
+// what one read of a sensor puts on the bus, for planning how much a link can carry
+struct i2c_cost {
+    int reads;  // write-reads and plain reads
+    int writes;
+    int wire;  // bytes on the bus over all of them, address bytes included
+    int period_ms;  // between reads
+};
+
 #define I2C_FAST_SPEED 400000
 #define I2C_NORMAL_SPEED 100000
 #define I2C_SLOW_SPEED 20000
@@ -33,10 +86,22 @@ struct cp2112_status_reply {
 #define I2C_LOW_TIMOUT 0
 #define I2C_ATTEMPTS 1
 
-#define CRC_WIDTH 8
-#define CRC_MSB (1 << (CRC_WIDTH - 1))
+// status polling starts just before the predicted end of a transfer and then backs off
+#define I2C_POLL_MIN_US 50
+#define I2C_POLL_MAX_US 1000
+#define I2C_POLL_TIMEOUT_US ((I2C_W_TIMEOUT + I2C_R_TIMEOUT) * 1000L)
+// an autosend reply needs a usb round trip on top of the transfer before status is worth asking for
+#define I2C_AUTOSEND_SLACK_MS 3
+// an ack probe is expected to be nacked, so it asks right away
+#define I2C_ACK_SLACK_MS 1
+// how long a status reply still on its way is waited for once the data is in
+#define I2C_DRAIN_MS 10
+
+// status requests timed for the usb round trip, the median is used
+#define I2C_ROUND_TRIPS 9
+
+// smbus PEC, the X^8 term is implied
 #define CRC_POLYNOMIAL 0x07
-// the X^8 term is implied
 
 #define MAIN_CHANNEL -1
 #define NO_CHANNEL -1
@@ -47,15 +112,39 @@ struct cp2112_status_reply {
 
 int dump_buffer(unsigned char *buf, int len);
 int cancel_transfer(hid_device *handle);
+int i2c_recover(hid_device *handle);
+long i2c_generation(hid_device *handle);
+void i2c_invalidate(hid_device *handle);
 int setup_gpio(hid_device *handle, int use_leds);
 int setup_i2c(hid_device *handle, int speed);
+int setup_autosend(hid_device *handle, int enable);
+int i2c_speed(hid_device *handle);
 int get_gpio(hid_device *handle);
 int set_gpio(hid_device *handle, int values, int bitmask);
-char crc_naive(char *buf, int len);
+unsigned char smbus_pec(const unsigned char *buf, int len, unsigned char crc);
+int i2c_check_pec(int address, int reg, unsigned char *data, int len);
 int i2c_status(hid_device *handle, struct cp2112_status_reply *status);
+struct cp2112_poll_stats *i2c_polls(hid_device *handle);
+long i2c_transfer_us(hid_device *handle, int bytes);
+long i2c_wire_us(int speed, int bytes);
+long i2c_round_trip_us(hid_device *handle);
+void i2c_cost_read(struct i2c_cost *cost, int len);
+void i2c_cost_write(struct i2c_cost *cost, int len);
+long i2c_cost_us(hid_device *handle, struct i2c_cost *cost, int speed, long round_trip_us);
+struct cp2112_counters *i2c_counters(hid_device *handle);
+void i2c_count_retry(hid_device *handle);
+int i2c_dump_latency(hid_device *handle, const char *name, FILE *f);
+void i2c_clear_latency(hid_device *handle);
+int i2c_poll(hid_device *handle, struct cp2112_status_reply *status, int bytes);
 int i2c_write(hid_device *handle, int address, unsigned char *data, int len);
 int i2c_wait(hid_device *handle);
+int i2c_read_block(hid_device *handle, int address, int reg, unsigned char *data, int len);
 int read_word(hid_device *handle, int address, int reg, int reply_length);
+int i2c_ack(hid_device *handle, int address);
+void cp2112_forget(hid_device *handle);
+int cp2112_capture(const char *path);
+void cp2112_capture_stop(void);
+void cp2112_name(hid_device *handle, const char *serial);
 int cleanup(hid_device *handle);
 int has_address(int address, const int *address_list);
 
@@ -0,0 +1,929 @@
+// A software CP2112 with a TCA9548A and sensors behind it.
+// It implements the hidapi calls that multilux uses, so it links in place of hidapi:
+//     make emu
+// which builds multilux-emu.  Nothing else changes, every report goes through cp2112.c as usual.
+//
+// Configured with the MULTILUX_EMU environment variable, ';' separated:
+//     usb=1000      one-way usb latency per report in microseconds (full speed HID is 1 frame)
+//     mux=0x70      address of the multiplexer on the main bus, 0 for none
+//     devices=...   comma separated channel-address pairs, same syntax as the command line
+//                   multiplexer paths like 0x71.3-0x10 add any multiplexers on the way
+//                   the chip is picked from the address: 0x10 VEML7700, 0x53 LTR390UV, else MLX90614
+//                   a device followed by @from or @from:until seconds is only plugged in for that long, 3-0x10@5:20
+//     lux=250       light level seen by the light sensors
+//     uv=30         uW/cm^2 seen by the LTR390UV
+//     temp=25       object temperature seen by the MLX90614 (ambient is 2C lower)
+//     nack=0        per-mille chance that any transfer gets nacked
+//     maxspeed=...  comma separated channel:hz pairs, a channel nacks everything clocked faster
+//                   than its long cable allows, e.g. maxspeed=1:100000,3:50000
+//     garble=0      per-mille chance that a read has one bit flipped on the wire
+//     seed=1        for the noise and the nacks
+//     adapters=1    how many identical CP2112s to enumerate, serials EMU0001, EMU0002...
+//     virtual=0     seconds to run on the virtual clock of tick.c, then stop as if control-c was pressed
+//                   the usb and bus latencies and the conversions all take simulated time, so a long
+//                   schedule runs as fast as the cpu gets through it; --stats=file reports how it went
+// for example
+//     MULTILUX_EMU="usb=1000;devices=*-0x5A,0-0x10,1-0x53,3-0x10" ./multilux-emu --fast 0-0x10-L:10:a.tsv
+//     MULTILUX_EMU="virtual=86400;devices=0-0x10,1-0x53" ./multilux-emu --stats=day.txt 0-0x10-L:60:a.tsv 1-0x53-*:60:b.tsv
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <wchar.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include <hidapi.h>
+#include "cp2112.h"
+#include "stats.h"
+#include "tick.h"
+#include "shadow.h"
+#include "veml7700.h"
+#include "ltr390uv.h"
+#include "mlx90614.h"
+
+#define EMU_MAX_CHIPS 160
+#define EMU_QUEUE 64
+#define EMU_NOISE 0.01
+#define EMU_SERIAL L"EMU%04d"
+#define EMU_MAX_ADAPTERS 8
+// how long a blocking read with nothing to come sleeps at a time
+#define EMU_BLOCK_NS 1000000000LL
+
+enum emu_chip {EMU_TCA9548A, EMU_VEML7700, EMU_LTR390UV, EMU_MLX90614};
+
+struct emu_chip_state
+{
+    enum emu_chip chip;
+    int address;
+    int mux;      // index of the parent multiplexer, -1 for the main bus
+    int channel;  // channel on the parent multiplexer
+    unsigned short regs[256];  // 16 bit for the VEML7700, the rest only use the low byte
+    int pointer;
+    long long started_ns;  // last (re)configuration, conversions count from here
+    long long plugged_ns;  // when it is connected, 0 for always
+    long long unplugged_ns;
+};
+
+struct emu_report
+{
+    long long ready_ns;  // when the host gets to see it
+    int len;
+    unsigned char data[CP2112_REPORT_SIZE];
+};
+
+struct hid_device_
+{
+    struct emu_chip_state chips[EMU_MAX_CHIPS];
+    int chip_count;
+    long long usb_ns;
+    int nack_permille;
+    int garble_permille;
+    int max_speed[8];  // per channel of the first multiplexer, 0 for no limit
+    unsigned int seed;
+    int adapters;
+    double virtual_s;
+    double lux;
+    double uv;
+    double temp;
+    int speed;
+    int autosend;
+    int blocking;
+    // the device side of the link, every time is tick_now() in ns
+    long long device_ns;  // when the last out report reached the device
+    int xfer_state;  // BUS_IDLE, or the outcome of the latest transfer
+    int xfer_read;
+    long long xfer_end_ns;
+    unsigned char rx[CP2112_MAX_TRANSFER];
+    int rx_len;
+    int rx_sent;
+    struct emu_report queue[EMU_QUEUE];
+    int q_head;
+    int q_count;
+};
+
+static struct hid_api_version emu_version = {HID_API_VERSION_MAJOR, HID_API_VERSION_MINOR, HID_API_VERSION_PATCH};
+// end of the virtual=seconds run, 0 when there is none or it is over
+static atomic_llong virtual_end_ns;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    long long t, end;
+    tick_now(&ts);
+    t = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    end = atomic_load(&virtual_end_ns);
+    if (end && t >= end && atomic_compare_exchange_strong(&virtual_end_ns, &end, 0)) {
+        raise(SIGINT);
+    }
+    return t;
+}
+
+static void sleep_until(long long t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(t / 1000000000LL);
+    ts.tv_nsec = (long)(t % 1000000000LL);
+    tick_sleep_until(&ts);
+}
+
+static double noise(hid_device *dev)
+{
+    // -1 to 1
+    dev->seed = dev->seed * 1103515245u + 12345u;
+    return ((double)((dev->seed >> 8) & 0xFFFF) / 32767.5) - 1.0;
+}
+
+static unsigned char emu_pec(unsigned char *buf, int len)
+{
+    // smbus crc-8, bit at a time is fine here
+    int i, bit;
+    unsigned char crc = 0;
+    for (i=0; i<len; i++) {
+        crc ^= buf[i];
+        for (bit=0; bit<8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+static int add_chip(hid_device *dev, enum emu_chip chip, int address, int mux, int channel)
+{
+    struct emu_chip_state *c;
+    if (dev->chip_count >= EMU_MAX_CHIPS) {
+        return -1;
+    }
+    c = &dev->chips[dev->chip_count];
+    memset(c, 0, sizeof(*c));
+    c->chip = chip;
+    c->address = address;
+    c->mux = mux;
+    c->channel = channel;
+    c->started_ns = now_ns();
+    switch (chip) {
+        case EMU_VEML7700:
+            c->regs[ALS_CONF] = 0x0001;  // shut down
+            c->regs[VEML_ID] = 0xC481;
+            break;
+        case EMU_LTR390UV:
+            c->regs[LTR_RATE] = 0x22;
+            c->regs[LTR_GAIN] = 0x01;
+            c->regs[LTR_ID] = 0xB2;
+            break;
+        case EMU_MLX90614:
+            c->regs[MLX_ADDRESS] = address;
+            break;
+        case EMU_TCA9548A:
+            break;
+    }
+    return dev->chip_count++;
+}
+
+static int find_mux(hid_device *dev, int address, int mux, int channel)
+{
+    // the multiplexer at address behind channel of mux, added when it isn't there yet
+    struct emu_chip_state *c;
+    int i;
+    for (i=0; i<dev->chip_count; i++) {
+        c = &dev->chips[i];
+        if (c->chip == EMU_TCA9548A && c->address == address && c->mux == mux && (mux < 0 || c->channel == channel)) {
+            return i;
+        }
+    }
+    return add_chip(dev, EMU_TCA9548A, address, mux, mux < 0 ? MAIN_CHANNEL : channel);
+}
+
+static int parse_devices(hid_device *dev, char *list, int mux)
+{
+    char *item, *save, *p;
+    int channel, address, n, parent, hop, c;
+    double from, until;
+    enum emu_chip chip;
+    for (item=strtok_r(list, ",", &save); item; item=strtok_r(NULL, ",", &save)) {
+        parent = mux;
+        if (!strncmp(item, "0x", 2)) {
+            // 0x70.2.0x71.3-0x10
+            parent = -1;
+            channel = MAIN_CHANNEL;
+            p = item;
+            while (1) {
+                n = 0;
+                if (sscanf(p, "%x.%d%n", &address, &hop, &n) != 2 || n == 0 || hop < 0 || hop > 7) {
+                    fprintf(stderr, "emulator: could not parse device '%s'\n", item);
+                    return -1;
+                }
+                parent = find_mux(dev, address, parent, channel);
+                channel = hop;
+                p += n;
+                if (*p != '.') {
+                    break;
+                }
+                p++;
+            }
+            if (parent < 0 || sscanf(p, "-%x", &address) != 1) {
+                fprintf(stderr, "emulator: could not parse device '%s'\n", item);
+                return -1;
+            }
+        } else if (sscanf(item, "*-%x", &address) == 1) {
+            channel = MAIN_CHANNEL;
+        } else if (sscanf(item, "%d-%x", &channel, &address) != 2) {
+            fprintf(stderr, "emulator: could not parse device '%s'\n", item);
+            return -1;
+        }
+        if (channel != MAIN_CHANNEL && parent < 0) {
+            fprintf(stderr, "emulator: '%s' needs a multiplexer\n", item);
+            return -1;
+        }
+        switch (address) {
+            case VEML7700_ADDR:
+                chip = EMU_VEML7700; break;
+            case LTR390UV_ADDR:
+                chip = EMU_LTR390UV; break;
+            default:
+                chip = EMU_MLX90614; break;
+        }
+        c = add_chip(dev, chip, address, channel == MAIN_CHANNEL ? -1 : parent, channel);
+        p = strchr(item, '@');
+        from = until = 0.0;
+        if (c >= 0 && p && sscanf(p, "@%lf:%lf", &from, &until) >= 1) {
+            dev->chips[c].plugged_ns = now_ns() + (long long)(from * 1e9);
+            dev->chips[c].unplugged_ns = until > 0.0 ? now_ns() + (long long)(until * 1e9) : 0;
+        }
+    }
+    return 0;
+}
+
+static void parse_speeds(hid_device *dev, char *list)
+{
+    char *item, *save;
+    int channel, hz;
+    for (item=strtok_r(list, ",", &save); item; item=strtok_r(NULL, ",", &save)) {
+        if (sscanf(item, "%d:%d", &channel, &hz) != 2 || channel < 0 || channel > 7) {
+            fprintf(stderr, "emulator: bad maxspeed '%s'\n", item);
+            continue;
+        }
+        dev->max_speed[channel] = hz;
+    }
+}
+
+static int configure(hid_device *dev, const char *env)
+{
+    char *conf, *item, *save, *value;
+    char *devices = NULL;
+    int mux_address = 0x70;
+    int mux = -1;
+    int res = 0;
+    dev->usb_ns = 1000000LL;
+    dev->nack_permille = 0;
+    dev->garble_permille = 0;
+    dev->seed = 1;
+    dev->adapters = 1;
+    dev->virtual_s = 0.0;
+    dev->lux = 250.0;
+    dev->uv = 30.0;
+    dev->temp = 25.0;
+    conf = strdup(env ? env : "");
+    for (item=strtok_r(conf, ";", &save); item; item=strtok_r(NULL, ";", &save)) {
+        value = strchr(item, '=');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        if (!strcmp(item, "usb")) {
+            dev->usb_ns = atoll(value) * 1000LL;
+        } else if (!strcmp(item, "mux")) {
+            mux_address = (int)strtol(value, NULL, 0);
+        } else if (!strcmp(item, "devices")) {
+            devices = value;
+        } else if (!strcmp(item, "lux")) {
+            dev->lux = atof(value);
+        } else if (!strcmp(item, "uv")) {
+            dev->uv = atof(value);
+        } else if (!strcmp(item, "temp")) {
+            dev->temp = atof(value);
+        } else if (!strcmp(item, "nack")) {
+            dev->nack_permille = atoi(value);
+        } else if (!strcmp(item, "maxspeed")) {
+            parse_speeds(dev, value);
+        } else if (!strcmp(item, "garble")) {
+            dev->garble_permille = atoi(value);
+        } else if (!strcmp(item, "seed")) {
+            dev->seed = (unsigned int)atoi(value);
+        } else if (!strcmp(item, "adapters")) {
+            dev->adapters = atoi(value);
+        } else if (!strcmp(item, "virtual")) {
+            dev->virtual_s = atof(value);
+        } else {
+            fprintf(stderr, "emulator: unknown option '%s'\n", item);
+        }
+    }
+    if (mux_address) {
+        mux = add_chip(dev, EMU_TCA9548A, mux_address, -1, MAIN_CHANNEL);
+    }
+    if (devices) {
+        res = parse_devices(dev, devices, mux);
+    } else {
+        char defaults[] = "*-0x5A,0-0x10,1-0x53";
+        res = parse_devices(dev, defaults, mux);
+    }
+    free(conf);
+    return res;
+}
+
+static int reachable(hid_device *dev, struct emu_chip_state *c)
+{
+    // follows the multiplexers back up to the main bus
+    struct emu_chip_state *m;
+    long long t = now_ns();
+    if (t < c->plugged_ns || (c->unplugged_ns && t >= c->unplugged_ns)) {
+        return false;
+    }
+    while (c->mux >= 0) {
+        m = &dev->chips[c->mux];
+        if (!(m->regs[0] & (1 << c->channel))) {
+            return false;
+        }
+        if (m->mux < 0 && dev->max_speed[c->channel] && dev->speed > dev->max_speed[c->channel]) {
+            return false;
+        }
+        c = m;
+    }
+    return true;
+}
+
+static double scene(hid_device *dev, double level, struct emu_chip_state *c)
+{
+    // slow drift so that the stats have something to show, plus a little noise
+    double t = (double)now_ns() / 1e9;
+    double drift = 1.0 + 0.05 * sin(t / 100.0 + (double)(c - dev->chips));
+    return level * drift * (1.0 + EMU_NOISE * noise(dev));
+}
+
+static unsigned int veml_value(hid_device *dev, struct emu_chip_state *c, int reg)
+{
+    int conf = c->regs[ALS_CONF];
+    int it = (conf >> 6) & 0x0F;
+    int gain = (conf >> 11) & 0x03;
+    double raw;
+    if (reg != ALS_DATA && reg != UNFILTERED_DATA) {
+        return c->regs[reg & 0xFF];
+    }
+    if (conf & 0x0001) {
+        // shut down, keeps the last result
+        return c->regs[reg];
+    }
+    raw = scene(dev, dev->lux, c) / (veml7700_i_scale[it] * veml7700_g_scale[gain]);
+    if (reg == UNFILTERED_DATA) {
+        raw *= 1.3;
+    }
+    if (raw > 0xFFFF) {
+        raw = 0xFFFF;
+    }
+    c->regs[reg] = (unsigned short)raw;
+    return c->regs[reg];
+}
+
+static unsigned int ltr_value(hid_device *dev, struct emu_chip_state *c, int reg)
+{
+    // the 20 bit results are spread over 3 registers
+    int it = (c->regs[LTR_RATE] >> 4) & 0x07;
+    int gain = c->regs[LTR_GAIN] & 0x07;
+    int uv_mode = (c->regs[LTR_CONTROL] >> 3) & 0x01;
+    double raw;
+    long long elapsed;
+    if (it > LTR_I_13MS) {
+        it = LTR_I_13MS;
+    }
+    if (gain > LTR_18X) {
+        gain = LTR_18X;
+    }
+    elapsed = now_ns() - c->started_ns;
+    if (reg == LTR_STATUS) {
+        if ((c->regs[LTR_CONTROL] & 0x02) && elapsed >= (long long)ltr_int_ms[it] * 1000000LL) {
+            return 0x08;
+        }
+        return 0x00;
+    }
+    if (reg == LTR_ALS0 && !uv_mode) {
+        raw = scene(dev, dev->lux, c) * ltr_gain_scale[gain] * ltr_int_ms[it] / 60.0;
+        raw = raw > 0xFFFFF ? 0xFFFFF : raw;
+        c->regs[LTR_ALS0] = (int)raw & 0xFF;
+        c->regs[LTR_ALS1] = ((int)raw >> 8) & 0xFF;
+        c->regs[LTR_ALS2] = ((int)raw >> 16) & 0x0F;
+    }
+    if (reg == LTR_UVS0 && uv_mode) {
+        raw = scene(dev, dev->uv, c) * ltr_gain_scale[gain] * ltr_int_ms[it] / 720.0;
+        raw = raw > 0xFFFFF ? 0xFFFFF : raw;
+        c->regs[LTR_UVS0] = (int)raw & 0xFF;
+        c->regs[LTR_UVS1] = ((int)raw >> 8) & 0xFF;
+        c->regs[LTR_UVS2] = ((int)raw >> 16) & 0x0F;
+    }
+    return c->regs[reg & 0xFF] & 0xFF;
+}
+
+static unsigned int mlx_value(hid_device *dev, struct emu_chip_state *c, int reg)
+{
+    double t;
+    switch (reg) {
+        case T_AMB:
+            t = dev->temp - 2.0 + 0.1 * noise(dev);
+            break;
+        case T_OBJ1:
+        case T_OBJ2:
+            t = dev->temp + 0.2 * noise(dev);
+            break;
+        default:
+            return c->regs[reg & 0xFF];
+    }
+    return (unsigned int)((t + 273.15 - MLX_VDD_OFFSET_DEGREES) / MLX_DEG_PER_COUNT) & 0xFFFF;
+}
+
+static void chip_write(struct emu_chip_state *c, unsigned char *data, int len)
+{
+    int i;
+    if (len < 1) {
+        return;
+    }
+    switch (c->chip) {
+        case EMU_TCA9548A:
+            // the last byte sent is what sticks
+            c->regs[0] = data[len-1];
+            break;
+        case EMU_VEML7700:
+            c->pointer = data[0];
+            if (len >= 3) {
+                c->regs[data[0]] = data[1] | (data[2] << 8);
+                if (data[0] == ALS_CONF) {
+                    c->started_ns = now_ns();
+                }
+            }
+            break;
+        case EMU_LTR390UV:
+            c->pointer = data[0];
+            for (i=1; i<len; i++) {
+                c->regs[c->pointer & 0xFF] = data[i];
+                if (c->pointer == LTR_CONTROL || c->pointer == LTR_RATE || c->pointer == LTR_GAIN) {
+                    c->started_ns = now_ns();
+                }
+                c->pointer++;
+            }
+            break;
+        case EMU_MLX90614:
+            // ram is read-only and eeprom writes are not modelled
+            c->pointer = data[0];
+            break;
+    }
+}
+
+static void chip_read(hid_device *dev, struct emu_chip_state *c, int reg, unsigned char *out, int len)
+{
+    unsigned char frame[5];
+    unsigned int word;
+    int i;
+    if (reg >= 0) {
+        c->pointer = reg;
+    }
+    for (i=0; i<len; i++) {
+        out[i] = 0xFF;
+    }
+    switch (c->chip) {
+        case EMU_TCA9548A:
+            for (i=0; i<len; i++) {
+                out[i] = c->regs[0];
+            }
+            break;
+        case EMU_VEML7700:
+            word = veml_value(dev, c, c->pointer);
+            out[0] = word & 0xFF;
+            if (len > 1) {
+                out[1] = (word >> 8) & 0xFF;
+            }
+            break;
+        case EMU_LTR390UV:
+            for (i=0; i<len; i++) {
+                out[i] = ltr_value(dev, c, c->pointer & 0xFF);
+                c->pointer++;
+            }
+            break;
+        case EMU_MLX90614:
+            word = mlx_value(dev, c, c->pointer);
+            frame[0] = c->address << 1;
+            frame[1] = c->pointer;
+            frame[2] = (c->address << 1) | 1;
+            frame[3] = word & 0xFF;
+            frame[4] = (word >> 8) & 0xFF;
+            for (i=0; i<len && i<2; i++) {
+                out[i] = frame[3+i];
+            }
+            if (len > 2) {
+                out[2] = emu_pec(frame, 5);
+            }
+            break;
+    }
+}
+
+static void queue_report(hid_device *dev, long long ready_ns, unsigned char *data, int len)
+{
+    struct emu_report *r;
+    if (dev->q_count >= EMU_QUEUE) {
+        return;  // the real thing would stall, dropping is the closest we can do
+    }
+    r = &dev->queue[(dev->q_head + dev->q_count) % EMU_QUEUE];
+    r->ready_ns = ready_ns;
+    r->len = len;
+    memset(r->data, 0, sizeof(r->data));
+    memcpy(r->data, data, len);
+    dev->q_count++;
+}
+
+static long long wire_ns(hid_device *dev, int bytes)
+{
+    return (long long)(bytes * 9 + 3) * 1000000000LL / (long long)dev->speed;
+}
+
+static void queue_read_data(hid_device *dev, long long ready_ns, int want)
+{
+    // DATA_READ_RESPONSE reports of up to 61 bytes each
+    unsigned char buf[CP2112_REPORT_SIZE];
+    int n;
+    while (want > 0 && dev->rx_sent < dev->rx_len) {
+        n = dev->rx_len - dev->rx_sent;
+        if (n > want) {
+            n = want;
+        }
+        if (n > CP2112_READ_PAYLOAD) {
+            n = CP2112_READ_PAYLOAD;
+        }
+        buf[0] = DATA_READ_RESPONSE;
+        buf[1] = BUS_GOOD;
+        buf[2] = n;
+        memcpy(buf+3, dev->rx + dev->rx_sent, n);
+        queue_report(dev, ready_ns, buf, n + 3);
+        dev->rx_sent += n;
+        want -= n;
+    }
+}
+
+static void start_transfer(hid_device *dev, long long arrive, int address, unsigned char *wdata, int wlen, int rlen)
+{
+    // everything that acks the address takes part, like on a real bus
+    // writes land in every chip and reads come back wired-AND
+    struct emu_chip_state *c;
+    unsigned char part[CP2112_MAX_TRANSFER];
+    int i, j, acked = 0;
+    if (dev->xfer_state == BUS_BUSY && arrive < dev->xfer_end_ns) {
+        return;  // busy, the request is dropped
+    }
+    if (rlen > CP2112_MAX_TRANSFER) {
+        rlen = CP2112_MAX_TRANSFER;
+    }
+    memset(dev->rx, 0xFF, rlen);
+    for (i=0; i<dev->chip_count; i++) {
+        c = &dev->chips[i];
+        if (c->address != address || !reachable(dev, c)) {
+            continue;
+        }
+        if (dev->nack_permille && (int)((noise(dev) + 1.0) * 500.0) < dev->nack_permille) {
+            continue;
+        }
+        acked++;
+        if (rlen == 0) {
+            chip_write(c, wdata, wlen);
+        } else {
+            chip_read(dev, c, wlen > 0 ? wdata[0] : -1, part, rlen);
+            for (j=0; j<rlen; j++) {
+                dev->rx[j] &= part[j];
+            }
+        }
+    }
+    if (acked && rlen > 0 && dev->garble_permille && (int)((noise(dev) + 1.0) * 500.0) < dev->garble_permille) {
+        j = (int)((noise(dev) + 1.0) * 0.5 * rlen * 8) % (rlen * 8);
+        dev->rx[j / 8] ^= 1 << (j % 8);
+    }
+    dev->xfer_read = rlen > 0;
+    dev->rx_sent = 0;
+    if (acked) {
+        dev->xfer_state = BUS_GOOD;
+        dev->rx_len = rlen;
+        dev->xfer_end_ns = arrive + wire_ns(dev, 1 + wlen + (rlen > 0 && wlen > 0 ? 1 : 0) + rlen);
+    } else {
+        dev->xfer_state = BUS_ERROR;
+        dev->rx_len = 0;
+        dev->xfer_end_ns = arrive + wire_ns(dev, 1);
+    }
+    if (acked && rlen > 0 && dev->autosend) {
+        queue_read_data(dev, dev->xfer_end_ns + dev->usb_ns, rlen);
+    }
+}
+
+static void queue_status(hid_device *dev, long long arrive)
+{
+    unsigned char buf[7];
+    memset(buf, 0, sizeof(buf));
+    buf[0] = XFER_STATUS_RESPONSE;
+    if (dev->xfer_state == BUS_IDLE) {
+        buf[1] = BUS_IDLE;
+    } else if (arrive < dev->xfer_end_ns) {
+        buf[1] = BUS_BUSY;
+        buf[2] = dev->xfer_read ? I2C_RD_INPROGRESS : I2C_WR_INPROGRESS;
+    } else if (dev->xfer_state == BUS_GOOD) {
+        buf[1] = BUS_GOOD;
+        buf[2] = I2C_SUCCESS;
+        buf[5] = (dev->rx_len >> 8) & 0xFF;
+        buf[6] = dev->rx_len & 0xFF;
+    } else {
+        buf[1] = BUS_ERROR;
+        buf[2] = I2C_TIMEOUT_NACK;
+    }
+    queue_report(dev, arrive + dev->usb_ns, buf, 7);
+}
+
+static void cancel(hid_device *dev)
+{
+    dev->xfer_state = BUS_IDLE;
+    dev->rx_len = 0;
+    dev->rx_sent = 0;
+}
+
+int hid_init(void)
+{
+    // the clock has to be switched before anything takes a time from it
+    hid_device *dev = calloc(1, sizeof(hid_device));
+    if (dev == NULL) {
+        return -1;
+    }
+    configure(dev, getenv("MULTILUX_EMU"));
+    if (dev->virtual_s > 0.0) {
+        tick_virtual();
+        atomic_store(&virtual_end_ns, now_ns() + (long long)(dev->virtual_s * 1e9));
+    }
+    free(dev);
+    return 0;
+}
+
+int hid_exit(void)
+{
+    return 0;
+}
+
+const struct hid_api_version *hid_version(void)
+{
+    return &emu_version;
+}
+
+const char *hid_version_str(void)
+{
+    return "emulated";
+}
+
+static int adapter_count(void)
+{
+    hid_device dev;
+    memset(&dev, 0, sizeof(dev));
+    configure(&dev, getenv("MULTILUX_EMU"));
+    if (dev.adapters < 1) {
+        return 1;
+    }
+    if (dev.adapters > EMU_MAX_ADAPTERS) {
+        return EMU_MAX_ADAPTERS;
+    }
+    return dev.adapters;
+}
+
+struct hid_device_info *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    struct hid_device_info *info, *head = NULL, **tail = &head;
+    wchar_t serial[16];
+    char path[32];
+    int i, n;
+    if ((vendor_id && vendor_id != CP2112_VID) || (product_id && product_id != CP2112_PID)) {
+        return NULL;
+    }
+    n = adapter_count();
+    for (i=0; i<n; i++) {
+        info = calloc(1, sizeof(*info));
+        snprintf(path, sizeof(path), "emulator:%i", i);
+        swprintf(serial, 16, EMU_SERIAL, i + 1);
+        info->path = strdup(path);
+        info->vendor_id = CP2112_VID;
+        info->product_id = CP2112_PID;
+        info->serial_number = wcsdup(serial);
+        info->manufacturer_string = wcsdup(L"multilux");
+        info->product_string = wcsdup(L"emulated CP2112");
+        *tail = info;
+        tail = &info->next;
+    }
+    return head;
+}
+
+void hid_free_enumeration(struct hid_device_info *devs)
+{
+    struct hid_device_info *next;
+    while (devs) {
+        next = devs->next;
+        free(devs->path);
+        free(devs->serial_number);
+        free(devs->manufacturer_string);
+        free(devs->product_string);
+        free(devs);
+        devs = next;
+    }
+}
+
+static hid_device *open_index(int index)
+{
+    hid_device *dev;
+    if (index < 0 || index >= adapter_count()) {
+        return NULL;
+    }
+    dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) {
+        return NULL;
+    }
+    dev->speed = I2C_NORMAL_SPEED;
+    dev->blocking = 1;
+    dev->xfer_state = BUS_IDLE;
+    if (configure(dev, getenv("MULTILUX_EMU"))) {
+        free(dev);
+        return NULL;
+    }
+    // same sensors on every adapter, but not the same noise
+    dev->seed += index;
+    dev->device_ns = now_ns();
+    return dev;
+}
+
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+    int index = 0;
+    if (vendor_id != CP2112_VID || product_id != CP2112_PID) {
+        return NULL;
+    }
+    if (serial_number && swscanf(serial_number, EMU_SERIAL, &index) == 1) {
+        index--;
+    } else if (serial_number) {
+        return NULL;
+    }
+    return open_index(index);
+}
+
+hid_device *hid_open_path(const char *path)
+{
+    int index = 0;
+    if (strncmp(path, "emulator", 8)) {
+        return NULL;
+    }
+    sscanf(path, "emulator:%i", &index);
+    return open_index(index);
+}
+
+void hid_close(hid_device *dev)
+{
+    free(dev);
+}
+
+const wchar_t *hid_error(hid_device *dev)
+{
+    return L"emulated CP2112";
+}
+
+int hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+    dev->blocking = !nonblock;
+    return 0;
+}
+
+int hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+    // interrupt out reports reach the device one per usb latency
+    unsigned char buf[CP2112_REPORT_SIZE];
+    long long arrive, now;
+    int n;
+    if (length < 1 || length > CP2112_REPORT_SIZE) {
+        return -1;
+    }
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, data, length);
+    now = now_ns();
+    arrive = (dev->device_ns > now ? dev->device_ns : now) + dev->usb_ns;
+    dev->device_ns = arrive;
+    switch (buf[0]) {
+        case DATA_WRITE:
+            start_transfer(dev, arrive, buf[1] >> 1, buf+3, buf[2], 0);
+            break;
+        case DATA_WRITE_READ:
+            start_transfer(dev, arrive, buf[1] >> 1, buf+5, buf[4], (buf[2] << 8) | buf[3]);
+            break;
+        case DATA_READ:
+            start_transfer(dev, arrive, buf[1] >> 1, NULL, 0, (buf[2] << 8) | buf[3]);
+            break;
+        case DATA_READ_FORCE:
+            n = (buf[1] << 8) | buf[2];
+            if (arrive < dev->xfer_end_ns) {
+                arrive = dev->xfer_end_ns;
+            }
+            queue_read_data(dev, arrive + dev->usb_ns, n);
+            break;
+        case XFER_STATUS_REQ:
+            queue_status(dev, arrive);
+            break;
+        case CANCEL_TRANSFER:
+            cancel(dev);
+            break;
+        default:
+            return -1;
+    }
+    return (int)length;
+}
+
+int hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+    struct emu_report *r;
+    long long deadline, end;
+    int n;
+    if (dev->q_count == 0) {
+        // real hardware blocks until a report comes, and with nothing asked for none is on its way,
+        // so this waits for the end of a virtual=seconds run, or for good like the hardware
+        while (milliseconds < 0) {
+            end = atomic_load(&virtual_end_ns);
+            if (end == 0 && tick_is_virtual()) {
+                return 0;
+            }
+            sleep_until(end ? end : now_ns() + EMU_BLOCK_NS);
+            now_ns();
+        }
+        sleep_until(now_ns() + (long long)milliseconds * 1000000LL);
+        return 0;
+    }
+    r = &dev->queue[dev->q_head];
+    if (milliseconds >= 0) {
+        deadline = now_ns() + (long long)milliseconds * 1000000LL;
+        if (r->ready_ns > deadline) {
+            sleep_until(deadline);
+            return 0;
+        }
+    }
+    sleep_until(r->ready_ns);
+    n = r->len < (int)length ? r->len : (int)length;
+    memcpy(data, r->data, n);
+    dev->q_head = (dev->q_head + 1) % EMU_QUEUE;
+    dev->q_count--;
+    return n;
+}
+
+int hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+    return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+    // control transfers are a full round trip
+    long long now = now_ns();
+    if (length < 1) {
+        return -1;
+    }
+    switch (data[0]) {
+        case SMBUS_CONFIG:
+            if (length < 14) {
+                return -1;
+            }
+            dev->speed = (data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+            if (dev->speed <= 0) {
+                dev->speed = I2C_NORMAL_SPEED;
+            }
+            dev->autosend = data[6];
+            break;
+        case CANCEL_TRANSFER:
+            cancel(dev);
+            break;
+        case GPIO_CONFIG:
+        case SET_GPIO:
+        case RESET_DEVICE:
+            break;
+        default:
+            return -1;
+    }
+    sleep_until(now + 2 * dev->usb_ns);
+    return (int)length;
+}
+
+int hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+    long long now = now_ns();
+    if (length < 2) {
+        return -1;
+    }
+    switch (data[0]) {
+        case GET_GPIO:
+            data[1] = 0x00;
+            break;
+        default:
+            return -1;
+    }
+    sleep_until(now + 2 * dev->usb_ns);
+    return 2;
+}
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include "heap.h"
+
+#define HEAP_MIN_SIZE 16
+
+static int earlier(struct heap_entry *a, struct heap_entry *b)
+{
+    if (a->when->tv_sec != b->when->tv_sec) {
+        return a->when->tv_sec < b->when->tv_sec;
+    }
+    return a->when->tv_nsec < b->when->tv_nsec;
+}
+
+static void place(struct heap *heap, int i, struct heap_entry *e)
+{
+    heap->entries[i] = *e;
+    if (e->pos) {
+        *e->pos = i;
+    }
+}
+
+static void sift_up(struct heap *heap, int i)
+{
+    struct heap_entry e = heap->entries[i];
+    int parent;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!earlier(&e, &heap->entries[parent])) {
+            break;
+        }
+        place(heap, i, &heap->entries[parent]);
+        i = parent;
+    }
+    place(heap, i, &e);
+}
+
+static void sift_down(struct heap *heap, int i)
+{
+    struct heap_entry e = heap->entries[i];
+    int child;
+    while ((child = 2*i + 1) < heap->count) {
+        if (child + 1 < heap->count && earlier(&heap->entries[child + 1], &heap->entries[child])) {
+            child++;
+        }
+        if (!earlier(&heap->entries[child], &e)) {
+            break;
+        }
+        place(heap, i, &heap->entries[child]);
+        i = child;
+    }
+    place(heap, i, &e);
+}
+
+void heap_init(struct heap *heap)
+{
+    heap->entries = NULL;
+    heap->count = 0;
+    heap->size = 0;
+}
+
+void heap_free(struct heap *heap)
+{
+    free(heap->entries);
+    heap_init(heap);
+}
+
+int heap_push(struct heap *heap, struct timespec *when, void *item, int *pos)
+{
+    // returns -1 when it can't grow
+    struct heap_entry *grown;
+    int size;
+    if (heap->count == heap->size) {
+        size = heap->size ? heap->size * 2 : HEAP_MIN_SIZE;
+        grown = realloc(heap->entries, size * sizeof(struct heap_entry));
+        if (grown == NULL) {
+            return -1;
+        }
+        heap->entries = grown;
+        heap->size = size;
+    }
+    heap->entries[heap->count].when = when;
+    heap->entries[heap->count].item = item;
+    heap->entries[heap->count].pos = pos;
+    heap->count++;
+    sift_up(heap, heap->count - 1);
+    return 0;
+}
+
+void *heap_top(struct heap *heap)
+{
+    return heap->count ? heap->entries[0].item : NULL;
+}
+
+struct timespec *heap_top_time(struct heap *heap)
+{
+    return heap->count ? heap->entries[0].when : NULL;
+}
+
+void *heap_remove(struct heap *heap, int i)
+{
+    // takes out entry i, 0 pops the top
+    void *item;
+    if (i < 0 || i >= heap->count) {
+        return NULL;
+    }
+    item = heap->entries[i].item;
+    if (heap->entries[i].pos) {
+        *heap->entries[i].pos = -1;
+    }
+    heap->count--;
+    if (i < heap->count) {
+        place(heap, i, &heap->entries[heap->count]);
+        heap_update(heap, i);
+    }
+    return item;
+}
+
+void heap_update(struct heap *heap, int i)
+{
+    // entry i's time changed, in either direction
+    if (i < 0 || i >= heap->count) {
+        return;
+    }
+    if (i > 0 && earlier(&heap->entries[i], &heap->entries[(i - 1) / 2])) {
+        sift_up(heap, i);
+    } else {
+        sift_down(heap, i);
+    }
+}
+
+void heap_retime(struct heap *heap, int i, struct timespec *when)
+{
+    // entry i now goes by a different timer
+    if (i < 0 || i >= heap->count) {
+        return;
+    }
+    heap->entries[i].when = when;
+    heap_update(heap, i);
+}
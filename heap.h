@@ -0,0 +1,34 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <time.h>
+
+// a binary min-heap of timers, the earliest on top
+// the times are pointers so a timer can be moved without copying it in and out,
+// but after one changes heap_update() has to put it back in order
+// an entry with a pos pointer is told where it is every time it moves, for updating it later
+
+struct heap_entry
+{
+    struct timespec *when;
+    void *item;
+    int *pos;
+};
+
+struct heap
+{
+    struct heap_entry *entries;
+    int count;
+    int size;  // allocated, grows as needed
+};
+
+void heap_init(struct heap *heap);
+void heap_free(struct heap *heap);
+int heap_push(struct heap *heap, struct timespec *when, void *item, int *pos);
+void *heap_top(struct heap *heap);
+struct timespec *heap_top_time(struct heap *heap);
+void *heap_remove(struct heap *heap, int i);
+void heap_update(struct heap *heap, int i);
+void heap_retime(struct heap *heap, int i, struct timespec *when);
+
+#endif /* HEAP_H */
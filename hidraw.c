@@ -0,0 +1,263 @@
+// Talks to the CP2112 through /dev/hidrawN directly instead of through hidapi.
+// It implements the hidapi calls that multilux uses, so it links in place of hidapi:
+//     HIDRAW=1 make
+// Linux only.  Devices are found with libudev, reports are plain read()/write() on the
+// device node, feature reports are HIDIOCSFEATURE/HIDIOCGFEATURE ioctls, and every wait is a poll().
+// It hasn't been timed against hidapi on real hardware yet, --stats=file on both builds shows the
+// write-read and status latencies to compare.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <wchar.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <libudev.h>
+
+#include <hidapi.h>
+#include "cp2112.h"
+
+struct hid_device_
+{
+    int fd;
+    int blocking;
+    wchar_t error[128];
+};
+
+static struct hid_api_version hidraw_version = {HID_API_VERSION_MAJOR, HID_API_VERSION_MINOR, HID_API_VERSION_PATCH};
+static struct udev *udev;
+
+static int set_error(hid_device *dev, int res)
+{
+    // keeps errno around for hid_error(), passes res through
+    if (dev && res < 0) {
+        swprintf(dev->error, sizeof(dev->error) / sizeof(wchar_t), L"%s", strerror(errno));
+    }
+    return res;
+}
+
+int hid_init(void)
+{
+    if (udev == NULL) {
+        udev = udev_new();
+    }
+    return udev ? 0 : -1;
+}
+
+int hid_exit(void)
+{
+    if (udev) {
+        udev_unref(udev);
+        udev = NULL;
+    }
+    return 0;
+}
+
+const struct hid_api_version *hid_version(void)
+{
+    return &hidraw_version;
+}
+
+const char *hid_version_str(void)
+{
+    return "hidraw";
+}
+
+static wchar_t *wide(const char *s)
+{
+    wchar_t *w;
+    size_t n;
+    if (s == NULL) {
+        s = "";
+    }
+    n = strlen(s) + 1;
+    w = calloc(n, sizeof(wchar_t));
+    if (w) {
+        mbstowcs(w, s, n);
+    }
+    return w;
+}
+
+struct hid_device_info *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    // every hidraw node whose parent hid device matches
+    struct udev_enumerate *e;
+    struct udev_list_entry *entry;
+    struct udev_device *raw, *hid;
+    struct hid_device_info *info, *head = NULL, **tail = &head;
+    const char *node, *id;
+    unsigned int bus, vid, pid;
+    if (hid_init()) {
+        return NULL;
+    }
+    e = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(e, "hidraw");
+    udev_enumerate_scan_devices(e);
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+        raw = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+        if (raw == NULL) {
+            continue;
+        }
+        node = udev_device_get_devnode(raw);
+        // the parent is owned by raw
+        hid = udev_device_get_parent_with_subsystem_devtype(raw, "hid", NULL);
+        id = hid ? udev_device_get_property_value(hid, "HID_ID") : NULL;
+        if (node == NULL || id == NULL || sscanf(id, "%x:%x:%x", &bus, &vid, &pid) != 3
+            || (vendor_id && vid != vendor_id) || (product_id && pid != product_id)) {
+            udev_device_unref(raw);
+            continue;
+        }
+        info = calloc(1, sizeof(*info));
+        if (info == NULL) {
+            udev_device_unref(raw);
+            break;
+        }
+        info->path = strdup(node);
+        info->vendor_id = vid;
+        info->product_id = pid;
+        info->serial_number = wide(udev_device_get_property_value(hid, "HID_UNIQ"));
+        info->manufacturer_string = wide("");
+        info->product_string = wide(udev_device_get_property_value(hid, "HID_NAME"));
+        *tail = info;
+        tail = &info->next;
+        udev_device_unref(raw);
+    }
+    udev_enumerate_unref(e);
+    return head;
+}
+
+void hid_free_enumeration(struct hid_device_info *devs)
+{
+    struct hid_device_info *next;
+    while (devs) {
+        next = devs->next;
+        free(devs->path);
+        free(devs->serial_number);
+        free(devs->manufacturer_string);
+        free(devs->product_string);
+        free(devs);
+        devs = next;
+    }
+}
+
+hid_device *hid_open_path(const char *path)
+{
+    hid_device *dev;
+    int fd;
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) {
+        close(fd);
+        return NULL;
+    }
+    dev->fd = fd;
+    dev->blocking = 1;
+    return dev;
+}
+
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+    struct hid_device_info *devs, *d;
+    hid_device *dev = NULL;
+    devs = hid_enumerate(vendor_id, product_id);
+    for (d=devs; d; d=d->next) {
+        if (serial_number && wcscmp(serial_number, d->serial_number)) {
+            continue;
+        }
+        dev = hid_open_path(d->path);
+        break;
+    }
+    hid_free_enumeration(devs);
+    return dev;
+}
+
+void hid_close(hid_device *dev)
+{
+    if (dev == NULL) {
+        return;
+    }
+    close(dev->fd);
+    free(dev);
+}
+
+const wchar_t *hid_error(hid_device *dev)
+{
+    if (dev == NULL) {
+        return L"hidraw";
+    }
+    return dev->error;
+}
+
+int hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+    dev->blocking = !nonblock;
+    return 0;
+}
+
+int hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+    // the CP2112 numbers all of its reports, so the first byte is already the report id
+    ssize_t res;
+    do {
+        res = write(dev->fd, data, length);
+    } while (res < 0 && errno == EINTR);
+    return set_error(dev, (int)res);
+}
+
+int hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+    // 0 on timeout, -1 waits forever
+    struct pollfd p;
+    ssize_t res;
+    p.fd = dev->fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    do {
+        res = poll(&p, 1, milliseconds);
+    } while (res < 0 && errno == EINTR);
+    if (res <= 0) {
+        return set_error(dev, (int)res);
+    }
+    if (p.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        errno = ENODEV;
+        return set_error(dev, -1);
+    }
+    do {
+        res = read(dev->fd, data, length);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    return set_error(dev, (int)res);
+}
+
+int hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+    return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+    int res;
+    do {
+        res = ioctl(dev->fd, HIDIOCSFEATURE(length), data);
+    } while (res < 0 && errno == EINTR);
+    return set_error(dev, res);
+}
+
+int hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+    // data[0] is the report id going in, and the report comes back in place
+    int res;
+    do {
+        res = ioctl(dev->fd, HIDIOCGFEATURE(length), data);
+    } while (res < 0 && errno == EINTR);
+    return set_error(dev, res);
+}
@@ -3,6 +3,7 @@
 #include "cp2112.h"
 #include "stats.h"
 #include "tick.h"
+#include "shadow.h"
 #include "ltr390uv.h"
 
 // use the ltr_rate enum to access this
@@ -27,6 +28,33 @@ const int ltr_less_int[] = {LTR_I_200MS, LTR_I_100MS, LTR_I_50MS, LTR_I_25MS, LT
 
 const int ltr390uv_addresses[] = {0x53, END_LIST};
 
+int ltr390uv_start(hid_device *handle, struct ltr390uv_state *sensor, int shared)
+{
+    // for --sync, standby and back so that the next conversion starts now
+    // reading the status in between throws away a result that was already waiting
+    // shared is for writes that go to several multiplexer channels at once,
+    // they can't be read from, so an old result stays flagged until it is read at the deadline
+    unsigned char standby = (sensor->uv_mode << 3) & 0x8;
+    int res;
+    res = shadow_write(handle, &sensor->regs, LTR390UV_ADDR, LTR_CONTROL, &standby, 1);
+    if (res < 0) {
+        return res;
+    }
+    if (!shared) {
+        ltr390uv_done(handle);
+    }
+    res = setup_ltr390uv(handle, sensor, 0);
+    if (res < 0) {
+        return res;
+    }
+    if (sensor->uv_mode) {
+        tick_sync_increment(&sensor->wait_until, ltr_int_ms[sensor->uvs_integration]);
+    } else {
+        tick_sync_increment(&sensor->wait_until, ltr_int_ms[sensor->als_integration]);
+    }
+    return 0;
+}
+
 int ltr390uv_clear_stats(struct ltr390uv_state *sensor)
 {
     clear_stats(&sensor->als_stats);
@@ -39,46 +67,15 @@ int ltr390uv_clear_stats(struct ltr390uv_state *sensor)
     return 0;
 }
 
-int ltr_same_settings(struct ltr390uv_state *sensor)
-{
-    enum ltr_gain g;
-    enum ltr_integration i;
-    enum ltr_rate r;
-    if (sensor->uv_mode != sensor->prev_mode) {
-        return false;
-    }
-    if (sensor->uv_mode) {
-        g = sensor->uvs_gain;
-        i = sensor->uvs_integration;
-        r = sensor->uvs_rate;
-    } else {
-        g = sensor->als_gain;
-        i = sensor->als_integration;
-        r = sensor->als_rate;
-    }
-    if (g != sensor->prev_gain) {
-        return false;
-    }
-    if (i != sensor->prev_integration) {
-        return false;
-    }
-    if (r != sensor->prev_rate) {
-        return false;
-    }
-    return true;
-}
-
 int setup_ltr390uv(hid_device *handle, struct ltr390uv_state *sensor, int force)
 {
     // whatever is calling this takes care of enable
-    unsigned char buf[5];
+    // only registers that change are written, and standby is only needed for new rate/gain
+    unsigned char rate, gain, control, standby;
     int res;
     enum ltr_gain g;
     enum ltr_integration i;
     enum ltr_rate r;
-    if (!force && ltr_same_settings(sensor)) {
-        return 0;
-    }
 
     if (sensor->uv_mode) {
         g = sensor->uvs_gain;
@@ -89,42 +86,34 @@ int setup_ltr390uv(hid_device *handle, struct ltr390uv_state *sensor, int force)
         i = sensor->als_integration;
         r = sensor->als_rate;
     }
-
-    // put it into standby
-    buf[0] = LTR_CONTROL;
-    buf[1] = (sensor->uv_mode << 3) & 0x8;
-    res = i2c_write(handle, LTR390UV_ADDR, buf, 2);
-    if (res < 0) {
-        return res;
+    rate = ((i & 0x7) << 4) | (r & 0x7);
+    gain = g & 0x07;
+    control = 0x02 | ((sensor->uv_mode << 3) & 0x8);
+    standby = (sensor->uv_mode << 3) & 0x8;
+    if (force) {
+        shadow_invalidate(&sensor->regs);
     }
-    // set up integration
-    if ((i != sensor->prev_integration && r != sensor->prev_rate) || force) {
-        buf[0] = LTR_RATE;
-        buf[1] = ((i & 0x7) << 4) | (r & 0x7);
-        res = i2c_write(handle, LTR390UV_ADDR, buf, 2);
+
+    // put it into standby so the next conversion starts with the new settings
+    if (!shadow_matches(handle, &sensor->regs, LTR_RATE, &rate, 1)
+        || !shadow_matches(handle, &sensor->regs, LTR_GAIN, &gain, 1)) {
+        res = shadow_write(handle, &sensor->regs, LTR390UV_ADDR, LTR_CONTROL, &standby, 1);
         if (res < 0) {
             return res;
         }
     }
+    // set up integration
+    res = shadow_write(handle, &sensor->regs, LTR390UV_ADDR, LTR_RATE, &rate, 1);
+    if (res < 0) {
+        return res;
+    }
     // set up gain
-    if (g != sensor->prev_gain || force) {
-        buf[0] = LTR_GAIN;
-        buf[1] = g & 0x07;
-        res = i2c_write(handle, LTR390UV_ADDR, buf, 2);
-        if (res < 0) {
-            return res;
-        }
+    res = shadow_write(handle, &sensor->regs, LTR390UV_ADDR, LTR_GAIN, &gain, 1);
+    if (res < 0) {
+        return res;
     }
-    // bring it out of standby
-    buf[0] = LTR_CONTROL;
-    buf[1] = 0x02 | ((sensor->uv_mode << 3) & 0x8);
-    res = i2c_write(handle, LTR390UV_ADDR, buf, 2);
-
-    sensor->prev_mode = sensor->uv_mode;
-    sensor->prev_gain = g;
-    sensor->prev_integration = i;
-    sensor->prev_rate = r;
-
+    // bring it out of standby, or just switch between ALS and UVS
+    res = shadow_write(handle, &sensor->regs, LTR390UV_ADDR, LTR_CONTROL, &control, 1);
     if (res < 0) {
         return res;
     }
@@ -143,8 +132,12 @@ int ltr390uv_check(hid_device *handle, int address, int force)
 
 int ltr390uv_done(hid_device *handle)
 {
+    // negative when the status can't be read
     int i;
     i = read_word(handle, LTR390UV_ADDR, LTR_STATUS, 1);
+    if (i < 0) {
+        return i;
+    }
     return (i & 0x08) > 0;
 }
 
@@ -174,31 +167,56 @@ double ltr_raw_to_lux(struct ltr390uv_state *sensor)
 
 int ltr390uv_read_raw(hid_device *handle, struct ltr390uv_state *sensor)
 {
-    int b0, b1, b2;
-    while (!ltr390uv_done(handle)) {;}
-    // what happens if you request several bytes?
+    // one status read per pass, the bus is left alone while a late conversion finishes
+    // returns the raw count, LTR_NOT_DONE with wait_until moved on a little, or -1
+    // past the tries every pass fails, so the retry policy backs off and can open the circuit,
+    // until a conversion finishes
+    unsigned char buf[3];
+    int res;
+    int int_ms = ltr_int_ms[sensor->uv_mode ? sensor->uvs_integration : sensor->als_integration];
+    res = ltr390uv_done(handle);
+    if (res < 0) {
+        return -1;
+    }
+    if (!res) {
+        if (sensor->not_done >= LTR_NOT_DONE_TRIES) {
+            return -1;
+        }
+        sensor->not_done++;
+        tick_sync_increment(&sensor->wait_until, int_ms / LTR_NOT_DONE_TRIES + 1);
+        return LTR_NOT_DONE;
+    }
+    sensor->not_done = 0;
+    // the register pointer auto-increments so one transaction gets all 3 bytes
     if (sensor->uv_mode) {
-        b0 = read_word(handle, LTR390UV_ADDR, LTR_UVS0, 1);
-        b1 = read_word(handle, LTR390UV_ADDR, LTR_UVS1, 1);
-        b2 = read_word(handle, LTR390UV_ADDR, LTR_UVS2, 1);
+        res = i2c_read_block(handle, LTR390UV_ADDR, LTR_UVS0, buf, 3);
     } else {
-        b0 = read_word(handle, LTR390UV_ADDR, LTR_ALS0, 1);
-        b1 = read_word(handle, LTR390UV_ADDR, LTR_ALS1, 1);
-        b2 = read_word(handle, LTR390UV_ADDR, LTR_ALS2, 1);
+        res = i2c_read_block(handle, LTR390UV_ADDR, LTR_ALS0, buf, 3);
     }
-    return (b2 & 0xF) << 16 | b1 << 8 | b0;
+    if (res != 3) {
+        return -1;
+    }
+    return (buf[2] & 0xF) << 16 | buf[1] << 8 | buf[0];
 }
 
 int ltr390uv_read(hid_device *handle, struct ltr390uv_state *sensor)
 {
+    int raw;
+    raw = ltr390uv_read_raw(handle, sensor);
+    if (raw == LTR_NOT_DONE) {
+        return 1;
+    }
+    if (raw < 0) {
+        return raw;
+    }
     switch (sensor->read_state) {
     case MEASURING_UVB:
-        sensor->uvs_raw = ltr390uv_read_raw(handle, sensor);
+        sensor->uvs_raw = raw;
         ltr_raw_to_uv(sensor);
         update_stats(&sensor->uvs_stats, sensor->uv_uw);
         break;
     case MEASURING_ALS:
-        sensor->als_raw = ltr390uv_read_raw(handle, sensor);
+        sensor->als_raw = raw;
         ltr_raw_to_lux(sensor);
         update_stats(&sensor->als_stats, sensor->lux);
         break;
@@ -234,6 +252,46 @@ int ltr390uv_read(hid_device *handle, struct ltr390uv_state *sensor)
     return 0;
 }
 
+static int period_ms(enum ltr_rate r, enum ltr_integration i)
+{
+    // a conversion never comes sooner than its integration, whatever the rate says
+    return ltr_rate_ms[r] > ltr_int_ms[i] ? ltr_rate_ms[r] : ltr_int_ms[i];
+}
+
+int ltr390uv_cost(struct ltr390uv_state *sensor, struct i2c_cost *cost)
+{
+    // one pass of ltr390uv_read() that comes on time, so its one status read finds the conversion done
+    // in * mode every pass flips control, and with different settings for the two it also
+    // goes through standby and rewrites rate and gain, see setup_ltr390uv()
+    int rate = (sensor->als_integration != sensor->uvs_integration || sensor->als_rate != sensor->uvs_rate);
+    int gain = sensor->als_gain != sensor->uvs_gain;
+    i2c_cost_read(cost, 1);
+    i2c_cost_read(cost, 3);
+    switch (sensor->mode) {
+    case 'U':
+        cost->period_ms = period_ms(sensor->uvs_rate, sensor->uvs_integration);
+        break;
+    case 'L':
+        cost->period_ms = period_ms(sensor->als_rate, sensor->als_integration);
+        break;
+    default:
+        i2c_cost_write(cost, 2);
+        if (rate || gain) {
+            i2c_cost_write(cost, 2);
+        }
+        if (rate) {
+            i2c_cost_write(cost, 2);
+        }
+        if (gain) {
+            i2c_cost_write(cost, 2);
+        }
+        cost->period_ms = (period_ms(sensor->als_rate, sensor->als_integration)
+            + period_ms(sensor->uvs_rate, sensor->uvs_integration)) / 2;
+        break;
+    }
+    return 0;
+}
+
 double ltr_normalize(int raw, int integration)
 {
     switch (integration) {
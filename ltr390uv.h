@@ -23,6 +23,11 @@ enum ltr_fsm {
 
 #define LTR_MAX_X LTR_18X
 #define LTR_MIN_X LTR_1X
+// a conversion that isn't done when its time comes is looked at again this many times,
+// spread over one integration time, before reads count as failed until one finishes
+#define LTR_NOT_DONE_TRIES 8
+// from ltr390uv_read_raw(), nothing to read yet
+#define LTR_NOT_DONE -2
 
 extern const int ltr390uv_addresses[];
 
@@ -38,11 +43,8 @@ struct ltr390uv_state
     enum ltr_gain uvs_gain;
     enum ltr_integration uvs_integration;
     enum ltr_rate uvs_rate;
-    enum ltr_gain prev_gain;
-    enum ltr_integration prev_integration;
-    enum ltr_rate prev_rate;
     int uv_mode;
-    int prev_mode;
+    struct shadow_map regs;
     struct running_stats als_stats;
     struct running_stats uvs_stats;
     int als_raw;
@@ -53,6 +55,7 @@ struct ltr390uv_state
     char mode;
     struct timespec wait_until;
     enum ltr_fsm read_state;
+    int not_done;  // status reads since the last sample that found the conversion still running
 };
 
 
@@ -72,12 +75,14 @@ extern const int ltr_more_gain[];
 extern const int ltr_less_gain[];
 
 int setup_ltr390uv(hid_device *handle, struct ltr390uv_state *sensor, int force);
+int ltr390uv_start(hid_device *handle, struct ltr390uv_state *sensor, int shared);
 int ltr390uv_clear_stats(struct ltr390uv_state *sensor);
 int ltr390uv_check(hid_device *handle, int address, int force);
 int ltr390uv_done(hid_device *handle);
 double ltr_raw_to_uv(struct ltr390uv_state *sensor);
 double ltr_raw_to_lux(struct ltr390uv_state *sensor);
 int ltr390uv_read(hid_device *handle, struct ltr390uv_state *sensor);
+int ltr390uv_cost(struct ltr390uv_state *sensor, struct i2c_cost *cost);
 double ltr_normalize(int raw, int integration);
 int ltr_autoscale(struct ltr390uv_state *sensor);
 int ltr390uv_process_mode(struct ltr390uv_state *sensor, char c);
@@ -9,6 +9,8 @@
 // There is a huge amount of IIR/FIR filtering options.
 // The exact integration time is hard to pin down.
 #define MLX_SAMPLE_TIME 200
+// immediate re-reads of a word with a bad PEC
+#define MLX_PEC_RETRIES 2
 
 //const int mlx90614_addresses[] = {ANY_ADDRESS, END_LIST};
 const int mlx90614_addresses[] = {0x5A, END_LIST};
@@ -21,28 +23,73 @@ double compute_celsius(int n)
 
 int mlx90614_read(hid_device *handle, struct mlx90614_state *sensor)
 {
-    int i;
-    // optional 3rd byte is CRC
+    unsigned char amb_buf[3], obj_buf[3];
+    int need_amb, need_obj, attempt;
+    // the 3rd byte is the smbus PEC
+    // a corrupt word is read again right away so it never reaches the stats
+    need_amb = sensor->mode=='*' || sensor->mode=='A';
+    need_obj = sensor->mode=='*' || sensor->mode=='O';
+    for (attempt=0; need_amb || need_obj; attempt++) {
+        if (attempt > MLX_PEC_RETRIES) {
+            return -1;
+        }
+        if (attempt) {
+            i2c_count_retry(handle);
+        }
+        if (need_amb && i2c_read_block(handle, sensor->address, T_AMB, amb_buf, 3) != 3) {
+            return -1;
+        }
+        if (need_obj && i2c_read_block(handle, sensor->address, T_OBJ1, obj_buf, 3) != 3) {
+            return -1;
+        }
+        if (need_amb) {
+            need_amb = !i2c_check_pec(sensor->address, T_AMB, amb_buf, 3);
+            sensor->pec_errors += need_amb;
+        }
+        if (need_obj) {
+            need_obj = !i2c_check_pec(sensor->address, T_OBJ1, obj_buf, 3);
+            sensor->pec_errors += need_obj;
+        }
+    }
     if (sensor->mode=='*' || sensor->mode=='A') {
-        i = read_word(handle, sensor->address, T_AMB, 3);
-        sensor->t_amb = compute_celsius(i & 0xFFFF);
+        sensor->t_amb = compute_celsius(amb_buf[1] << 8 | amb_buf[0]);
         update_stats(&sensor->t_amb_stats, sensor->t_amb);
     }
     if (sensor->mode=='*' || sensor->mode=='O') {
-        i = read_word(handle, sensor->address, T_OBJ1, 3);
-        sensor->t_obj = compute_celsius(i & 0xFFFF);
+        sensor->t_obj = compute_celsius(obj_buf[1] << 8 | obj_buf[0]);
         update_stats(&sensor->t_obj_stats, sensor->t_obj);
     }
     tick_sync_increment(&sensor->wait_until, MLX_SAMPLE_TIME);
     return 0;
 }
 
+int mlx90614_start(hid_device *handle, struct mlx90614_state *sensor)
+{
+    // for --sync, the chip converts all the time and its filter can't be restarted, so it is ready now
+    tick_now(&sensor->wait_until);
+    return 0;
+}
+
+int mlx90614_cost(struct mlx90614_state *sensor, struct i2c_cost *cost)
+{
+    // one pass of mlx90614_read() without PEC errors
+    if (sensor->mode=='*' || sensor->mode=='A') {
+        i2c_cost_read(cost, 3);
+    }
+    if (sensor->mode=='*' || sensor->mode=='O') {
+        i2c_cost_read(cost, 3);
+    }
+    cost->period_ms = MLX_SAMPLE_TIME;
+    return 0;
+}
+
 int mlx90614_clear_stats(struct mlx90614_state *sensor)
 {
     sensor->t_amb = NO_TEMPERATURE;
     sensor->t_obj = NO_TEMPERATURE;
     clear_stats(&sensor->t_amb_stats);
     clear_stats(&sensor->t_obj_stats);
+    sensor->pec_errors = 0;
     sensor->t_amb_stats.unit = "ambient C";
     sensor->t_obj_stats.unit = "object C";
     return 0;
@@ -93,9 +140,10 @@ int mlx90614_tsv_row(struct mlx90614_state *sensor, FILE *f)
     if (sensor->mode == '*' || sensor->mode == 'A') {
         stats_tsv_row(&(sensor->t_amb_stats), f);
     }
+    fprintf(f, "\t%i", sensor->pec_errors);
     return 0;
 }
 
-char *mlx90614_debug_header = "";
+char *mlx90614_debug_header = "\tpec errors";
 char *mlx90614_mode_help = "Valid modes for the MLX90614 are * (all), O (object), A (ambient).";
 
@@ -24,11 +24,14 @@ struct mlx90614_state
     struct running_stats t_amb_stats;
     struct running_stats t_obj_stats;
     char mode;
+    int pec_errors;  // this interval, each one was read again
     struct timespec wait_until;
 };
 
 double compute_celsius(int n);
 int mlx90614_read(hid_device *handle, struct mlx90614_state *sensor);
+int mlx90614_start(hid_device *handle, struct mlx90614_state *sensor);
+int mlx90614_cost(struct mlx90614_state *sensor, struct i2c_cost *cost);
 int mlx90614_clear_stats(struct mlx90614_state *sensor);
 int mlx90614_check(hid_device *handle, int address, int force);
 int mlx90614_process_mode(struct mlx90614_state *sensor, char c);
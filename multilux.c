@@ -4,12 +4,18 @@
 #include <math.h>
 #include <signal.h>
 #include <time.h>
+#include <wchar.h>
+#include <pthread.h>
 
 #include <hidapi.h>
 #include "cp2112.h"
 #include "stats.h"
 #include "tick.h"
+#include "ring.h"
+#include "heap.h"
+#include "retry.h"
 #include "tca9548a.h"
+#include "shadow.h"
 #include "veml7700.h"
 #include "ltr390uv.h"
 #include "mlx90614.h"
@@ -24,12 +30,34 @@
 
 enum device_list {TCA9548A, VEML7700, LTR390UV, MLX90614, END_SENSOR_LIST};
 char device_names[][20] = {"TCA9548A", "VEML7700", "LTR390UV", "MLX90614", "NONE"};
-#define MAX_SENSORS 16
+#define MAX_ADAPTERS CP2112_MAX_LINKS
+// every multiplexer leaf plus the main bus, use channel+1 as the index
+#define BUS_SEGMENTS (TCA9548A_MAX_LEAVES + 1)
+
+// per-channel clock calibration, fastest first
+const int calibrate_speeds[] = {I2C_FAST_SPEED, 200000, I2C_NORMAL_SPEED, 50000, I2C_SLOW_SPEED, 0};
+#define CALIBRATE_READS 20
+// the ack sweep of --scanall skips the reserved addresses at either end
+#define SCAN_FIRST 0x08
+#define SCAN_LAST 0x77
+// how late a sensor on another channel may get while the current channel is drained
+#define AFFINITY_MS 20
+// the --hotplug rescan probes one spot at a time,
+// only while the next sensor isn't due for at least the idle time
+#define HOTPLUG_IDLE_MS 15
+#define HOTPLUG_PERIOD_MS 200
+#define HOTPLUG_NAME 256
+// the planned bus load that only gets a warning, --budget makes it a hard limit
+#define PLAN_BUDGET 100
+// for when the usb round trip can't be timed, a full speed interrupt endpoint is polled every 1ms
+#define PLAN_ROUND_TRIP_US 1000
 
 struct sensor_state
 {
     // hardware things
-    int channel;
+    int index;  // in the sensor table
+    int adapter;
+    int channel;  // leaf of the adapter's multiplexers
     int address;
     char mode;
     int hw;
@@ -39,21 +67,115 @@ struct sensor_state
     struct ltr390uv_state ltr390uv_sensor;
     int readings;  // could be different from the running_stats readings for some sensors
     // logging things
-    long int next_report_time;
+    long int next_report_time;  // in tick_seconds()
     int report_interval;
     char *file_name;
     char *error;
     int errors;
     int zero_halt;
+    int offline;  // stopped answering, only the --hotplug rescan looks for it
     long read_ns;
     long pass_ns;
+    int switches;  // mux channel changes made to reach this sensor
+    long cost_us;  // planned bus time of one read
+    int period_ms;  // planned time between reads
+    double load;  // its share of the adapter's bus in the plan
+    long long sync_epoch;  // --sync epoch its conversion was last started for
+    long long first_epoch;  // --sync epochs of the samples in this interval, 0 for none
+    long long last_epoch;
+    struct retry_state retry;
     // stuff that points into the sensor object in use
     struct timespec *wait_until;
 };
 
+// every sensor, in command line order and then as --hotplug finds them
+// each one is allocated on its own so that pointers to it stay good while the list grows
+struct sensor_table
+{
+    struct sensor_state **list;
+    int count;
+    int size;
+};
+
+// the sensors of one bus segment, soonest first
+struct segment
+{
+    struct heap sensors;
+    int pos;  // in the adapter's schedule, -1 when it has nothing to run
+};
+
+// one of these is posted for every sensor read
+// the snapshot is everything needed to show or log the sensor without touching the live copy
+struct completion
+{
+    int sensor;
+    int result;
+    long read_ns;
+    struct timespec finished;
+    time_t log_time;  // non-zero when the snapshot closes out a report interval
+    struct cp2112_poll_stats polls;
+    double load;  // of the adapter's plan
+    struct sensor_state snapshot;
+};
+
+#define COMPLETION_SLOTS 256
+#define CONSUMER_SLEEP_US 2000
+// on the virtual clock every wake up of the main thread costs a real thread switch,
+// so it takes bigger gulps, still well short of filling a ring
+#define CONSUMER_VIRTUAL_SLEEP_US 200000
+// the status line is for a person, by the real clock even on the virtual one
+#define STATUS_REDRAW_MS 50
+
+// each CP2112 gets its own acquisition thread and completion ring
+// sensors are shared in one table but a thread only touches the ones with its index,
+// and finds them through its own schedule
+struct adapter
+{
+    int index;
+    char serial[32];
+    hid_device *handle;
+    struct tca9548a_tree mux;
+    int speed;  // from --slow/--fast, for anything that wasn't calibrated
+    int speeds[BUS_SEGMENTS];  // calibrated clock of each leaf, 0 when unknown
+    struct sensor_table *sensors;
+    struct segment segments[BUS_SEGMENTS];
+    struct heap schedule;  // segments that have sensors, by their soonest one
+    int active;  // has sensors and a running thread
+    struct ring completions;
+    pthread_t thread;
+    struct cp2112_poll_stats polls;  // last seen by the main thread
+    int stats_seen;  // the stats_requested that was last dumped
+    int hotplug_leaf;  // where the rescan is
+    int hotplug_spot;
+    struct timespec hotplug_next;
+    long round_trip_us;  // timed at startup, for the planner
+    double load;  // planned share of the bus, kept current by the acquisition thread
+    double load_seen;  // last seen by the main thread
+    int load_warned;
+    int sync_stride;  // --sync epochs from one burst to the next, in the plan
+    struct timespec started;  // when the acquisition thread did, for the schedule report
+    long reads;
+    long long busy_ns;  // in reads, against the time since started
+    struct latency_histogram lateness;  // how far behind its timer each read started, each --sync burst its epoch
+};
+
 volatile int force_exit;
+volatile sig_atomic_t stats_requested;
+char *stats_file_name;
+struct retry_policy retry_policy;
+int affinity_ms = AFFINITY_MS;
+// --hotplug, sensors the rescan finds get a file named from the template
+char *hotplug_template;
+int hotplug_interval;
+// --budget, 0 when an overloaded bus is only a warning
+int plan_budget;
+// --sync epoch length, 0 when every sensor runs on its own timer
+int sync_ms;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
 
-struct tca9548a_state tca9548a_device;  // global because only 1 is supported for now
+struct adapter adapters[MAX_ADAPTERS];
+int adapter_count;
 
 void exit_handler(int sig_num)
 {
@@ -62,210 +184,603 @@ void exit_handler(int sig_num)
     force_exit = 1;
 }
 
-int init_status(struct sensor_state sensors[MAX_SENSORS])
+void stats_handler(int sig_num)
+{
+    // the usb threads own the counters, so they do the dumping
+    stats_requested++;
+}
+
+int init_sensor(struct sensor_state *sensor)
+{
+    sensor->index = -1;
+    sensor->adapter = 0;
+    retry_init(&sensor->retry, &retry_policy);
+    shadow_invalidate(&sensor->veml7700_sensor.regs);
+    shadow_invalidate(&sensor->ltr390uv_sensor.regs);
+    sensor->channel = DUMMY_CHANNEL;
+    sensor->hw = END_SENSOR_LIST;
+    sensor->veml7700_sensor.gain = ALS_GAIN_8DIV;
+    sensor->veml7700_sensor.integration = ALS_IT_100ms;
+    tick_now(&sensor->veml7700_sensor.wait_until);
+    sensor->ltr390uv_sensor.als_gain = LTR_3X;
+    sensor->ltr390uv_sensor.als_integration = LTR_I_100MS;
+    sensor->ltr390uv_sensor.uvs_gain = LTR_3X;
+    sensor->ltr390uv_sensor.uvs_integration = LTR_I_100MS;
+    tick_now(&sensor->ltr390uv_sensor.wait_until);
+    tick_now(&sensor->mlx90614_sensor.wait_until);
+    sensor->file_name = NULL;
+    sensor->error = "";
+    sensor->errors = 0;
+    sensor->zero_halt = 0;
+    sensor->offline = 0;
+    sensor->read_ns = 0L;
+    sensor->pass_ns = 0L;
+    sensor->switches = 0;
+    sensor->cost_us = 0L;
+    sensor->period_ms = 0;
+    sensor->load = 0.0;
+    sensor->sync_epoch = 0;
+    sensor->first_epoch = 0;
+    sensor->last_epoch = 0;
+    veml7700_clear_stats(&sensor->veml7700_sensor);
+    ltr390uv_clear_stats(&sensor->ltr390uv_sensor);
+    sensor->mlx90614_sensor.address = 0;
+    mlx90614_clear_stats(&sensor->mlx90614_sensor);
+    return 0;
+}
+
+struct sensor_state *new_sensor(void)
+{
+    // a sensor with the defaults, NULL when out of memory
+    struct sensor_state *sensor = calloc(1, sizeof(struct sensor_state));
+    if (sensor) {
+        init_sensor(sensor);
+    }
+    return sensor;
+}
+
+int table_append(struct sensor_table *table, struct sensor_state *sensor)
+{
+    // returns the sensor's index, or -1 when the table can't grow
+    struct sensor_state **grown;
+    int size;
+    if (sensor == NULL) {
+        return -1;
+    }
+    if (table->count == table->size) {
+        size = table->size ? table->size * 2 : 16;
+        grown = realloc(table->list, size * sizeof(struct sensor_state *));
+        if (grown == NULL) {
+            return -1;
+        }
+        table->list = grown;
+        table->size = size;
+    }
+    sensor->index = table->count;
+    table->list[table->count] = sensor;
+    return table->count++;
+}
+
+struct sensor_state *add_sensor(struct sensor_table *table)
+{
+    struct sensor_state *sensor = new_sensor();
+    if (table_append(table, sensor) < 0) {
+        free(sensor);
+        return NULL;
+    }
+    return sensor;
+}
+
+void free_sensors(struct sensor_table *table)
 {
     int i;
-    for (i=0; i<MAX_SENSORS; i++) {
-        sensors[i].channel = DUMMY_CHANNEL;
-        sensors[i].veml7700_sensor.gain = ALS_GAIN_8DIV;
-        sensors[i].veml7700_sensor.integration = ALS_IT_100ms;
-        clock_gettime(CLOCK_REALTIME, &sensors[i].veml7700_sensor.wait_until);
-        sensors[i].ltr390uv_sensor.als_gain = LTR_3X;
-        sensors[i].ltr390uv_sensor.als_integration = LTR_I_100MS;
-        sensors[i].ltr390uv_sensor.uvs_gain = LTR_3X;
-        sensors[i].ltr390uv_sensor.uvs_integration = LTR_I_100MS;
-        clock_gettime(CLOCK_REALTIME, &sensors[i].ltr390uv_sensor.wait_until);
-        clock_gettime(CLOCK_REALTIME, &sensors[i].mlx90614_sensor.wait_until);
-        sensors[i].file_name = NULL;
-        sensors[i].error = "";
-        sensors[i].errors = 0;
-        sensors[i].zero_halt = 0;
-        sensors[i].read_ns = 0L;
-        sensors[i].pass_ns = 0L;
-        veml7700_clear_stats(&sensors[i].veml7700_sensor);
-        ltr390uv_clear_stats(&sensors[i].ltr390uv_sensor);
-        sensors[i].mlx90614_sensor.address = 0;
-        mlx90614_clear_stats(&sensors[i].mlx90614_sensor);
+    for (i=0; i<table->count; i++) {
+        free(table->list[i]);
     }
-    return 0;
+    free(table->list);
+    table->list = NULL;
+    table->count = 0;
+    table->size = 0;
+}
+
+int channel_speed(struct adapter *adapter, int channel)
+{
+    // the clock to run a channel at, only reprograms the CP2112 when it changes
+    int speed = adapter->speed;
+    if (channel >= -1 && channel < BUS_SEGMENTS - 1 && adapter->speeds[channel + 1]) {
+        speed = adapter->speeds[channel + 1];
+    }
+    if (speed == i2c_speed(adapter->handle)) {
+        return 0;
+    }
+    return setup_i2c(adapter->handle, speed);
 }
 
-int channel_select(hid_device *handle, int channel)
+int channel_select(struct adapter *adapter, int channel)
 {
-    if (channel == MAIN_CHANNEL || channel == NO_CHANNEL) {
-        //return set_gpio(handle, 0x00, 0xFC);
-        return tca9548a_select_channel(handle, &tca9548a_device, -1, true);
+    // MAIN_CHANNEL or NO_CHANNEL disconnect every multiplexer
+    int res;
+    res = tca9548a_select_leaf(adapter->handle, &adapter->mux, channel);
+    // the select goes out at the old channel's speed, which already works for the main bus
+    if (res < 0) {
+        return res;
+    }
+    return channel_speed(adapter, channel);
+}
+
+void schedule_init(struct adapter *adapter)
+{
+    int i;
+    heap_init(&adapter->schedule);
+    for (i=0; i<BUS_SEGMENTS; i++) {
+        heap_init(&adapter->segments[i].sensors);
+        adapter->segments[i].pos = -1;
+    }
+}
+
+void schedule_free(struct adapter *adapter)
+{
+    int i;
+    heap_free(&adapter->schedule);
+    for (i=0; i<BUS_SEGMENTS; i++) {
+        heap_free(&adapter->segments[i].sensors);
+        adapter->segments[i].pos = -1;
     }
-    //if (channel < 2) {
-    //    return -1;
-    //}
-    if (channel > 7) {
+}
+
+int schedule_add(struct adapter *adapter, struct sensor_state *sensor)
+{
+    // puts the sensor in its segment, and the segment in the schedule when it wasn't there yet
+    struct segment *seg = &adapter->segments[sensor->channel + 1];
+    if (heap_push(&seg->sensors, sensor->wait_until, sensor, NULL)) {
         return -1;
     }
-    //return set_gpio(handle, 1<<channel, 0xFC);
-    return tca9548a_select_channel(handle, &tca9548a_device, channel, false);
+    if (seg->pos < 0) {
+        return heap_push(&adapter->schedule, heap_top_time(&seg->sensors), seg, &seg->pos);
+    }
+    heap_retime(&adapter->schedule, seg->pos, heap_top_time(&seg->sensors));
+    return 0;
+}
+
+void schedule_done(struct adapter *adapter, struct sensor_state *sensor, int keep)
+{
+    // the sensor that was just run is always the top of its segment and its wait_until has moved on
+    // with keep false it leaves the schedule until schedule_add() puts it back
+    struct segment *seg = &adapter->segments[sensor->channel + 1];
+    if (keep) {
+        heap_update(&seg->sensors, 0);
+    } else {
+        heap_remove(&seg->sensors, 0);
+    }
+    if (seg->sensors.count == 0) {
+        heap_remove(&adapter->schedule, seg->pos);
+        return;
+    }
+    heap_retime(&adapter->schedule, seg->pos, heap_top_time(&seg->sensors));
 }
 
-int next_sensor(struct sensor_state sensors[MAX_SENSORS])
+void schedule_remove(struct adapter *adapter, struct sensor_state *sensor)
 {
-    // a fair scheduling algo
-    // tries to give each sensor an equal number of reads per report_interval
-    int i, best_i, elapsed;
-    time_t t = time(NULL);
-    double reads, score, best_score;
-    struct sensor_state *sensor;
-    best_i = -1;
-    best_score = 1e10;
-    for (i=MAX_SENSORS-1; i>=0; i--) {
-        sensor = &sensors[i];
-        if (sensor->channel == DUMMY_CHANNEL) {
-            continue;
+    // takes the sensor out of the schedule from anywhere in its segment
+    struct segment *seg = &adapter->segments[sensor->channel + 1];
+    int i;
+    for (i=0; i<seg->sensors.count; i++) {
+        if (seg->sensors.entries[i].item == sensor) {
+            heap_remove(&seg->sensors, i);
+            break;
         }
-        if (sensor->zero_halt) {
-            continue;
+    }
+    if (seg->sensors.count == 0) {
+        heap_remove(&adapter->schedule, seg->pos);
+        return;
+    }
+    heap_retime(&adapter->schedule, seg->pos, heap_top_time(&seg->sensors));
+}
+
+struct sensor_state *next_sensor2(struct adapter *adapter, struct timespec *now, struct timespec *deadline)
+{
+    // finds whatever is most expired
+    // but stays on the selected channel while that puts nothing else more than affinity_ms further behind
+    // the top of the schedule is the most expired and the top of the selected segment is the nearest,
+    // so this looks at two sensors however many there are
+    // returns the sensor if it is ready to run, otherwise NULL and the deadline to sleep until
+    struct segment *seg;
+    struct sensor_state *best, *near = NULL;
+    long best_us, near_us;
+    int current = adapter->mux.leaf;
+    seg = heap_top(&adapter->schedule);
+    if (seg == NULL) {
+        *deadline = *now;
+        tick_increment(deadline, 1000);
+        return NULL;
+    }
+    best = heap_top(&seg->sensors);
+    best_us = tick_difference_us(now, best->wait_until);
+    if (current >= -1 && current < BUS_SEGMENTS - 1) {
+        near = heap_top(&adapter->segments[current + 1].sensors);
+    }
+    // whatever on this channel is due as well, unless that leaves the others too late
+    // one that isn't due yet is never waited for while something elsewhere already is
+    if (near && near != best && best_us >= 0) {
+        near_us = tick_difference_us(now, near->wait_until);
+        if (near_us >= 0 && best_us - near_us <= affinity_ms * 1000L) {
+            best = near;
+            best_us = near_us;
+        }
+    }
+    if (best_us < 0) {
+        *deadline = *best->wait_until;
+        return NULL;
+    }
+    return best;
+}
+
+long sensor_cost(struct adapter *adapter, struct sensor_state *sensor, struct i2c_cost *cost)
+{
+    // predicted bus time of one read, the driver's transfers at the channel's clock
+    // when the adapter has sensors on other segments too this takes the worst case,
+    // a select write for every multiplexer on the way before each read
+    int i, depth, speed = adapter->speed;
+    memset(cost, 0, sizeof(struct i2c_cost));
+    switch (sensor->hw) {
+        case VEML7700:
+            veml7700_cost(&sensor->veml7700_sensor, cost);
+            break;
+        case LTR390UV:
+            ltr390uv_cost(&sensor->ltr390uv_sensor, cost);
+            break;
+        case MLX90614:
+            mlx90614_cost(&sensor->mlx90614_sensor, cost);
+            break;
+        default:
+            return 0L;
+    }
+    // --sync restarts every conversion on top of the read, see the *_start() functions,
+    // and then the period is how long the restarted conversion takes
+    if (sync_ms) {
+        switch (sensor->hw) {
+            case VEML7700:
+                i2c_cost_write(cost, 3);
+                i2c_cost_write(cost, 3);
+                break;
+            case LTR390UV:
+                i2c_cost_write(cost, 2);
+                i2c_cost_read(cost, 1);
+                i2c_cost_write(cost, 2);
+                cost->period_ms = ltr_int_ms[sensor->ltr390uv_sensor.uv_mode ?
+                    sensor->ltr390uv_sensor.uvs_integration : sensor->ltr390uv_sensor.als_integration];
+                break;
+            case MLX90614:
+                cost->period_ms = 0;
+                break;
         }
-        reads = sensor->readings + 1 + (double)sensor->errors/2;
-        elapsed = sensor->report_interval + 1 - (sensor->next_report_time - t);
-        score = (double)(reads * sensor->report_interval) / (double)elapsed;
-        if (score < best_score) {
-            best_score = score;
-            best_i = i;
+    }
+    // that includes a sensor that isn't scheduled yet on a segment of its own
+    if (adapter->schedule.count > 1 || (adapter->schedule.count == 1 && adapter->segments[sensor->channel + 1].pos < 0)) {
+        depth = tca9548a_depth(&adapter->mux, sensor->channel);
+        for (i=0; i<depth; i++) {
+            i2c_cost_write(cost, 1);
         }
     }
-    return best_i;
+    if (sensor->channel >= -1 && sensor->channel < BUS_SEGMENTS - 1 && adapter->speeds[sensor->channel + 1]) {
+        speed = adapter->speeds[sensor->channel + 1];
+    }
+    return i2c_cost_us(adapter->handle, cost, speed, adapter->round_trip_us);
 }
 
-int next_sensor2(struct sensor_state sensors[MAX_SENSORS])
+void plan_sensor(struct adapter *adapter, struct sensor_state *sensor)
 {
-    // finds whatever is most expired
-    // returns sensor index if its ready to run
-    // otherwise returns -1*ms to wait for a sensor
-    // probably should use a heap but there isn't much going on
-    int i, best_i, ms, best_ms;
+    // brings the sensor's share of the planned load up to date
+    // autoscaling, going offline and coming back all change it, so it is done again after every read
+    // nothing here touches the bus
+    struct i2c_cost cost;
+    double load = 0.0;
+    sensor->cost_us = sensor_cost(adapter, sensor, &cost);
+    sensor->period_ms = sync_ms ? sync_ms * adapter->sync_stride : cost.period_ms;
+    if (!sensor->offline && !sensor->zero_halt && sensor->period_ms > 0) {
+        load = (double)sensor->cost_us / (sensor->period_ms * 1000.0);
+    }
+    adapter->load += load - sensor->load;
+    sensor->load = load;
+}
+
+int plan_admits(struct adapter *adapter, struct sensor_state *sensor)
+{
+    // whether the sensor fits in what --budget leaves of its bus, always true without one
+    struct i2c_cost cost;
+    long us;
+    if (!plan_budget) {
+        return true;
+    }
+    us = sensor_cost(adapter, sensor, &cost);
+    if (sync_ms) {
+        cost.period_ms = sync_ms * adapter->sync_stride;
+    }
+    if (cost.period_ms <= 0) {
+        return true;
+    }
+    return (adapter->load - sensor->load + (double)us / (cost.period_ms * 1000.0)) * 100.0 <= plan_budget;
+}
+
+int plan_sync(struct adapter *adapter)
+{
+    // how many --sync epochs one burst and sweep take, the slowest conversion with all of the bus time around it
     struct sensor_state *sensor;
-    best_i = -1;
-    best_ms = -1000;
-    for (i=MAX_SENSORS-1; i>=0; i--) {
-        sensor = &sensors[i];
-        if (sensor->channel == DUMMY_CHANNEL) {
+    struct i2c_cost cost;
+    long busy_us = 0L;
+    int s, i, longest = 0;
+    for (s=0; s<BUS_SEGMENTS; s++) {
+        for (i=0; i<adapter->segments[s].sensors.count; i++) {
+            sensor = adapter->segments[s].sensors.entries[i].item;
+            busy_us += sensor_cost(adapter, sensor, &cost);
+            if (cost.period_ms > longest) {
+                longest = cost.period_ms;
+            }
+        }
+    }
+    adapter->sync_stride = (int)((longest * 1000L + busy_us) / (sync_ms * 1000L)) + 1;
+    return adapter->sync_stride;
+}
+
+double planned_rate(struct adapter *adapter, struct sensor_state *sensor)
+{
+    // reads per second the plan expects, a bus over capacity slows every sensor down alike
+    double rate;
+    if (sensor->period_ms <= 0) {
+        return 0.0;
+    }
+    rate = 1000.0 / sensor->period_ms;
+    if (adapter->load > 1.0) {
+        rate /= adapter->load;
+    }
+    return rate;
+}
+
+int show_plan(struct sensor_table *sensors)
+{
+    // what each sensor should get out of its bus
+    // returns how many adapters are planned over the budget
+    char chan[TCA9548A_NAME];
+    struct adapter *adapter;
+    struct sensor_state *s;
+    int i, over = 0;
+    int limit = plan_budget ? plan_budget : PLAN_BUDGET;
+    printf("Planned I2C load:\n");
+    for (i=0; i<sensors->count; i++) {
+        s = sensors->list[i];
+        if (s->channel == DUMMY_CHANNEL || s->zero_halt) {
             continue;
         }
-        if (sensor->zero_halt) {
+        adapter = &adapters[s->adapter];
+        if (adapter_count > 1) {
+            printf("%s/", adapter->serial);
+        }
+        printf("%s-0x%X %s: %.2fms every %ims, %.1f/s\n", tca9548a_leaf_name(&adapter->mux, s->channel, chan),
+            s->address, device_names[s->hw], s->cost_us / 1000.0, s->period_ms, planned_rate(adapter, s));
+    }
+    for (i=0; i<adapter_count; i++) {
+        adapter = &adapters[i];
+        if (!adapter->active) {
             continue;
         }
-        ms = tick_missed(sensor->wait_until);
-        if (ms > best_ms) {
-            best_i = i;
-            best_ms = ms;
+        printf("%s: %.0f%% of the bus, usb round trip %.2fms\n", adapter->serial, adapter->load * 100.0, adapter->round_trip_us / 1000.0);
+        if (adapter->load * 100.0 > limit) {
+            printf("%s is over %s%i%%, sensors will be read less often than they could be.\n",
+                adapter->serial, plan_budget ? "the --budget of " : "", limit);
+            over++;
         }
     }
-    if (best_ms < 0) {
-        return best_ms;
+    return over;
+}
+
+int dump_schedule(struct adapter *adapter, FILE *f)
+{
+    // what the scheduler got out of the bus, next to what the plan said it would
+    // call from the adapter's thread, or once it has stopped
+    char chan[TCA9548A_NAME];
+    struct sensor_state *s;
+    double seconds = tick_elapsed_ns(&adapter->started) / 1e9;
+    int i;
+    if (seconds <= 0.0) {
+        return 0;
+    }
+    fprintf(f, "%s: %li reads in %.0fs, bus busy %.1f%%, planned %.1f%%\n", adapter->serial, adapter->reads,
+        seconds, adapter->busy_ns / 1e9 / seconds * 100.0, adapter->load * 100.0);
+    fprintf(f, "%-12s ", "late");
+    latency_summary(&adapter->lateness, f);
+    fprintf(f, "\n");
+    pthread_mutex_lock(&hotplug_lock);
+    for (i=0; i<adapter->sensors->count; i++) {
+        s = adapter->sensors->list[i];
+        if (s->adapter != adapter->index || s->channel == DUMMY_CHANNEL || s->zero_halt) {
+            continue;
+        }
+        fprintf(f, "%s-0x%X %s: %i reads, %.2f/s, planned %.2f/s%s\n", tca9548a_leaf_name(&adapter->mux, s->channel, chan),
+            s->address, device_names[s->hw], s->readings, s->readings / seconds, planned_rate(adapter, s),
+            s->offline ? ", offline" : "");
     }
-    return best_i;
+    pthread_mutex_unlock(&hotplug_lock);
+    return 0;
 }
 
-char pretty_channel(int c)
+int dump_stats(struct adapter *adapter)
 {
-    if (c == MAIN_CHANNEL) {
-        return '*';
+    // to the console and appended to the --stats file
+    FILE *f;
+    time_t t = tick_wall_seconds(tick_seconds());
+    pthread_mutex_lock(&stats_lock);
+    printf("\n");
+    i2c_dump_latency(adapter->handle, adapter->serial, stdout);
+    dump_schedule(adapter, stdout);
+    fflush(stdout);
+    if (stats_file_name) {
+        f = fopen(stats_file_name, "a");
+        if (f) {
+            fprintf(f, "%s", ctime(&t));
+            i2c_dump_latency(adapter->handle, adapter->serial, f);
+            dump_schedule(adapter, f);
+            fprintf(f, "\n");
+            fclose(f);
+        }
     }
-    return c + 48;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
 }
 
-int show_status(struct sensor_state sensors[MAX_SENSORS])
+int show_status(struct sensor_table *sensors)
 {
-    char item[25];
-    char chan;
+    char item[64];
+    char chan[TCA9548A_NAME];
+    char name[TCA9548A_NAME + 8];
     int i;
     struct sensor_state *s;
     long sum_pass = 0L, sum_sensor = 0L;
+    long polls = 0L, transactions = 0L;
+    double load = 0.0;
     printf("\r");
-    for (i=0; i<MAX_SENSORS; i++) {
-        s = &sensors[i];
+    for (i=0; i<sensors->count; i++) {
+        s = sensors->list[i];
         if (s->channel == DUMMY_CHANNEL) {
             continue;
         }
         sum_pass += s->pass_ns;
         sum_sensor += s->read_ns;
-        chan = pretty_channel(s->channel);
+        tca9548a_leaf_name(&adapters[s->adapter].mux, s->channel, chan);
+        // the adapter goes inside the padded column, or every cell after it is pushed along
+        if (adapter_count > 1) {
+            snprintf(name, sizeof(name), "%i/%s", s->adapter, chan);
+        } else {
+            snprintf(name, sizeof(name), "%s", chan);
+        }
         if (s->zero_halt) {
-            snprintf(item, 24, "%c-0x%X: DONE", chan, s->address);
+            snprintf(item, sizeof(item), "%s-0x%X: DONE", name, s->address);
+        } else if (s->offline) {
+            snprintf(item, sizeof(item), "%s-0x%X: offline", name, s->address);
         } else if (strlen(s->error)) {
-            snprintf(item, 24, "%c-0x%X: %s", chan, s->address, s->error);
+            snprintf(item, sizeof(item), "%s-0x%X: %s", name, s->address, s->error);
         } else if (s->hw == VEML7700) {
-            snprintf(item, 24, "%c: %.2flx", chan, s->veml7700_sensor.lux);
+            snprintf(item, sizeof(item), "%s: %.2flx", name, s->veml7700_sensor.lux);
         } else if (s->hw == MLX90614) {
-            snprintf(item, 24, "%c-0x%X: %.2fC", chan, s->address, s->mlx90614_sensor.t_obj);
+            snprintf(item, sizeof(item), "%s-0x%X: %.2fC", name, s->address, s->mlx90614_sensor.t_obj);
         } else if (s->hw == LTR390UV) {
             switch (s->mode) {
             case 'L':
-                snprintf(item, 24, "%c: %.2flx", chan, s->ltr390uv_sensor.lux); break;
+                snprintf(item, sizeof(item), "%s: %.2flx", name, s->ltr390uv_sensor.lux); break;
             case 'U':
-                snprintf(item, 24, "%c: %.2fuW", chan, s->ltr390uv_sensor.uv_uw); break;
+                snprintf(item, sizeof(item), "%s: %.2fuW", name, s->ltr390uv_sensor.uv_uw); break;
             default:
-                snprintf(item, 24, "%c: %.2flx %.2fuW", chan, s->ltr390uv_sensor.lux, s->ltr390uv_sensor.uv_uw); break;
+                snprintf(item, sizeof(item), "%s: %.2flx %.2fuW", name, s->ltr390uv_sensor.lux, s->ltr390uv_sensor.uv_uw); break;
             }
         }
         printf("%-24s", item);
     }
     printf("i2c: %.0f%%  ", 100*(double)sum_sensor/(double)sum_pass);
+    for (i=0; i<adapter_count; i++) {
+        polls += adapters[i].polls.total;
+        transactions += adapters[i].polls.transactions;
+        if (adapters[i].load_seen > load) {
+            load = adapters[i].load_seen;
+        }
+    }
+    printf("plan: %.0f%%  ", 100*load);
+    if (transactions) {
+        printf("polls: %.2f  ", (double)polls/(double)transactions);
+    }
     fflush(stdout);
     return 0;
 }
 
-int maybe_log(struct sensor_state *sensor, int force)
+int write_row(struct sensor_state *sensor, time_t t)
 {
+    // t is from tick_seconds(), the row gets the wall clock time that goes with it
     FILE *f;
-    time_t t;
     char fulltime[30];
 
-    // has enough time elapsed?
-    t = time(NULL);
-    if (!force && sensor->next_report_time > t) {
-        return 0;
-    }
-
     f = fopen(sensor->file_name, "a");
     if (f == NULL) {
         sensor->error = "bad file";
         return -1;
     }
+    t = tick_wall_seconds(t);
     strftime(fulltime, 30, "%a %b %d %H:%M:%S %Y", localtime(&t));
     fprintf(f, "%s\t%ld", fulltime, t);
 
     switch (sensor->hw) {
         case VEML7700:
             veml7700_tsv_row(&(sensor->veml7700_sensor), f);
+            break;
+        case LTR390UV:
+            ltr390uv_tsv_row(&(sensor->ltr390uv_sensor), f);
+            break;
+        case MLX90614:
+            mlx90614_tsv_row(&(sensor->mlx90614_sensor), f);
+            break;
+    }
+    fprintf(f, "\t%i\t%i\t%i\t%i", (int)round((double)sensor->read_ns/1e6), sensor->errors, sensor->retry.retries, sensor->switches);
+    if (sync_ms) {
+        fprintf(f, "\t%lld\t%lld", sensor->first_epoch, sensor->last_epoch);
+    }
+    fprintf(f, "\t%s", sensor->error);
+    fprintf(f, "\n");
+    fclose(f);
+    return 0;
+}
+
+int end_interval(struct sensor_state *sensor)
+{
+    switch (sensor->hw) {
+        case VEML7700:
             clear_stats(&sensor->veml7700_sensor.als_stats);
             clear_stats(&sensor->veml7700_sensor.unf_stats);
             break;
         case LTR390UV:
-            ltr390uv_tsv_row(&(sensor->ltr390uv_sensor), f);
             clear_stats(&sensor->ltr390uv_sensor.als_stats);
             clear_stats(&sensor->ltr390uv_sensor.uvs_stats);
             break;
         case MLX90614:
-            mlx90614_tsv_row(&(sensor->mlx90614_sensor), f);
             clear_stats(&sensor->mlx90614_sensor.t_obj_stats);
             clear_stats(&sensor->mlx90614_sensor.t_amb_stats);
+            sensor->mlx90614_sensor.pec_errors = 0;
             //sensor->mlx90614_sensor.t_amb = NO_TEMPERATURE;
             //sensor->mlx90614_sensor.t_obj = NO_TEMPERATURE;
             break;
     }
-    fprintf(f, "\t%i\t%i\t%s", (int)round((double)sensor->read_ns/1e6), sensor->errors, sensor->error);
-    fprintf(f, "\n");
-
-    // clean up
-    fclose(f);
     sensor->next_report_time += sensor->report_interval;
     sensor->read_ns = 0L;
     sensor->pass_ns = 1L;
     sensor->error = "";
     sensor->errors = 0;
+    sensor->switches = 0;
+    sensor->first_epoch = 0;
+    sensor->last_epoch = 0;
+    retry_clear(&sensor->retry);
     return 0;
 }
 
+int maybe_log(struct sensor_state *sensor, int force)
+{
+    time_t t;
+
+    // has enough time elapsed?
+    t = tick_seconds();
+    if (!force && sensor->next_report_time > t) {
+        return 0;
+    }
+    if (write_row(sensor, t)) {
+        return -1;
+    }
+    return end_interval(sensor);
+}
+
+long next_boundary(int interval)
+{
+    // when the first report interval ends, in tick_seconds()
+    // it still ends on a multiple of interval in wall clock time so that rows land on round times
+    time_t t = tick_seconds();
+    time_t w = tick_wall_seconds(t);
+    return t + (1 + w/interval) * interval - w;
+}
+
 int exists(char *file_name)
 {
     struct stat buf;
@@ -296,12 +811,28 @@ int maybe_header(struct sensor_state *sensor)
             break;
     }
 
-    fprintf(f, "\ti2c ms\terrors\terror msg");
+    fprintf(f, "\ti2c ms\terrors\tretries\tswitches");
+    if (sync_ms) {
+        fprintf(f, "\tfirst epoch\tlast epoch");
+    }
+    fprintf(f, "\terror msg");
     fprintf(f, "\n");
     fclose(f);
     return 0;
 }
 
+char *arg_value(char *prefix, int argc, char *argv[])
+{
+    // for --flag=value, returns the value or NULL
+    int i;
+    for (i=1; i<argc; i++) {
+        if (!strncmp(prefix, argv[i], strlen(prefix))) {
+            return argv[i] + strlen(prefix);
+        }
+    }
+    return NULL;
+}
+
 int has_arg(char *flag, int argc, char *argv[])
 {
     int i;
@@ -315,23 +846,49 @@ int has_arg(char *flag, int argc, char *argv[])
 
 int show_help()
 {
-    printf("multilux [--noblink] [--slow] channel_num-i2c_addr-data_chan:integrate_seconds:file_name.tsv [more channels]\n\n");
+    printf("multilux [--noblink] [--slow | --fast | --nocalibrate] [--noautosend] [--retry=policy] [--affinity=ms] [--budget=percent] [--sync=ms] [--hotplug=integrate_seconds:template] [--stats=file] [--record=file] [--cache=file] [serial/]channel_num-i2c_addr-data_chan:integrate_seconds:file_name.tsv [more channels]\n\n");
     printf("    --scan searches for all devices on the bus.  It produces channel_number-i2c_address pairs and then exits.\n");
+    printf("    --scanall also tries every other address from 0x%02X to 0x%02X, which finds sensors at addresses they don't normally use but takes several times longer.\n", SCAN_FIRST, SCAN_LAST);
+    printf("    --cache=file is written by --scan or --scanall with every device it found.  Otherwise the devices it lists are only checked for their own chip at startup.\n");
     printf("    --noblink disables the indicator LEDs.\n");
     printf("    --slow runs I2C at 20kHz instead of 100kHz.\n");
-    printf("    --fast runs I2C at 400kHz instead of 100kHz.\n\n");
+    printf("    --fast runs I2C at 400kHz instead of 100kHz.\n");
+    printf("    --nocalibrate keeps every channel at 100kHz.  Otherwise each channel is tested at startup and runs at the fastest clock its sensors reliably answer at.\n");
+    printf("        --slow and --fast also turn calibration off.\n");
+    printf("    --noautosend polls for read data instead of letting the CP2112 send it when ready.\n");
+    printf("    --retry=immediate,backoff_ms,max_ms,trip_after[,open_ms] sets how every sensor handles failed reads.  Default is %i,%i,%i,%i,%i.\n",
+        RETRY_IMMEDIATE, RETRY_BACKOFF_MS, RETRY_BACKOFF_MAX_MS, RETRY_TRIP_AFTER, RETRY_OPEN_MS);
+    printf("        A failed read is tried again immediately, then the sensor backs off with a doubling delay up to max_ms.\n");
+    printf("        After trip_after failed passes in a row it is only probed every open_ms until it answers.\n");
+    printf("    --affinity=ms lets sensors on other multiplexer channels run up to ms late while the selected channel is drained.  Default is %i, 0 always reads the most overdue sensor first.\n", AFFINITY_MS);
+    printf("    --budget=percent refuses to start when any CP2112 is planned at more than percent of its bus, and keeps --hotplug sensors waiting until they fit.\n");
+    printf("        The plan is printed at startup, from the transfers each sensor needs, the I2C clock and the USB round trip.  Without --budget a plan over %i%% is only a warning.\n", PLAN_BUDGET);
+    printf("    --sync=ms reads every sensor once an epoch of ms, for readings that line up in time across channels and files.\n");
+    printf("        All conversions are restarted together at the start of an epoch, with identical sensors behind one multiplexer sharing the writes,\n");
+    printf("        and all of them are read once the slowest is done.  Epochs are numbered from the wall clock, and each row gets the first and last epoch in it.\n");
+    printf("        An epoch shorter than the slowest conversion is stretched to the next boundary.  MLX90614s can't be restarted and are only read in step.\n");
+    printf("    --hotplug=integrate_seconds:template rescans every known channel in the background, one address at a time while the bus is idle.\n");
+    printf("        A supported sensor that shows up is logged with all of its data to a file named from the template,\n");
+    printf("        where %%s is the CP2112 serial number, %%c the channel, %%a the address and %%d the device, like --hotplug=10:%%c-%%a-%%d.tsv\n");
+    printf("        A sensor whose circuit opens (see --retry) is marked offline and not read until the rescan finds it again.\n");
+    printf("    --record=file captures all USB traffic with timestamps, for playing back with multilux-replay (make replay).\n");
+    printf("    --stats=file appends bus latency histograms, error counters and the reads each sensor got against the plan to the file on exit and on SIGUSR1.  SIGUSR1 always prints them.\n\n");
     printf("    channel_num is the multipexer channel that enables a particular bus.  Must be * (for the main bus) or between 0 and 7.\n");
+    printf("        0-7 are the channels of the multiplexer with the lowest address.  Any other one is given as a path:\n");
+    printf("        0x71.3 is channel 3 of the multiplexer at 0x71, and 0x70.2.0x71.3 is channel 3 of a multiplexer at 0x71 behind channel 2 of the one at 0x70.\n");
     printf("    i2c_addr is the hex address a particular device.  Must be between 0x01 and 0x7F.\n");
     printf("    data_chan is which data channels to log from a device.  Each sensor has unique 1-letter options.  * will log all.\n");
-    printf("    For example '2-0x10-L' looks on channel #2 for a device at 0x10 (VEML7700) and records only the Lux channel.\n\n");
+    printf("    For example '2-0x10-L' looks on channel #2 for a device at 0x10 (VEML7700) and records only the Lux channel.\n");
+    printf("    serial is the serial number of the CP2112 to use when more than one is plugged in.  --scan lists them.  Defaults to the first one.\n\n");
     printf("    integrate_seconds is the duration to average readings.\n");
     printf("    file_name will have data appended to it. ':' cannot appear in the file name.\n\n");
     printf("HARDWARE\n");
     printf("The hardware consists of 2 main pieces: the CP2112 USB-I2C adapter and the TCA9548A multiplexer.  ");
-    printf("At the present time only a single multiplexer is supported.  Up to 16 devices are supported.  Devices may all use different integrate_seconds.  ");
+    printf("Each CP2112 may have up to 8 multiplexers (0x70-0x77) on its main bus and more cascaded behind their channels, %i in all.  A cascaded multiplexer can't share an address with any multiplexer that is connected at the same time.  Several CP2112s may be used at once, each with its own USB thread.  There is no limit on the number of devices.  Devices may all use different integrate_seconds.  ", TCA9548A_MAX_MUXES);
     printf("Every SDA and SCL line used will need its own pullup resistor.  That is up to 18 if all 8 channels are used.  (2 for the CP2112 and 2*8 for each output of the CA9548A.)  ");
     printf("1k-10k ohms is recommended.  (Standard mode is usually fine with 10k.  Fast mode will do better with resistors nearer to 1k.)  Remember to connect the TCA9548A's reset pin to Vcc.\n\n");
-    printf("You may add or remove channels at any time by pressing control-c to exit the application.  Edit the channel options and restart the application.  (This is why it appends to the data file.)\n\n");
+    printf("You may add or remove channels at any time by pressing control-c to exit the application.  Edit the channel options and restart the application.  (This is why it appends to the data file.)  ");
+    printf("With --hotplug, sensors may also be plugged into the channels of known multiplexers while it runs.\n\n");
     printf("The output file is tab-separated with the following columns:\n");
     printf("    human readable time\n");
     printf("    seconds since epoch (use this for graphing)\n");
@@ -340,7 +897,7 @@ int show_help()
     printf("    minimum\n");
     printf("    maximum\n");
     printf("    number of samples in the average\n");
-    printf("    several fields for debugging: device settings, error count, error messages\n\n");
+    printf("    several fields for debugging: device settings, i2c time, error count, immediate retries, channel switches, error messages\n\n");
     printf("Currently supported sensors:\n");
     printf("    VEML7700: lux\n");
     printf("    LTR390UV: lux, UVB\n");
@@ -349,15 +906,28 @@ int show_help()
     return 0;
 }
 
-int parse_args(struct sensor_state sensors[MAX_SENSORS], int argc, char *argv[])
+int find_adapter(char *serial, int len)
+{
+    // returns the adapter index or -1
+    int i;
+    for (i=0; i<adapter_count; i++) {
+        if (strlen(adapters[i].serial) == len && !strncmp(adapters[i].serial, serial, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int parse_args(struct sensor_table *sensors, int argc, char *argv[])
 {
     // returns the number of channels
-    // channel-0xaddress-mode:integrate_seconds:file_name
-    int res, i, channel, address, duration, count, t;
+    // [serial/]channel-0xaddress-mode:integrate_seconds:file_name
+    // where channel can also be a multiplexer path like 0x71.3
+    int res, i, channel, address, duration, count, adapter;
     char mode;
-    char *name;
+    char *name, *arg, *slash, *colon, *rest;
+    struct sensor_state *sensor;
     count = 0;
-    t = (int)time(NULL);
     for (i=1; i<argc; i++) {
         if (strlen(argv[i]) < 1) {
             continue;
@@ -365,16 +935,38 @@ int parse_args(struct sensor_state sensors[MAX_SENSORS], int argc, char *argv[])
         if (argv[i][0] == '-') {
             continue;
         }
-        if (count > MAX_SENSORS) {
-            printf("%i sensor limit exceeded.\n", MAX_SENSORS);
-            continue;
+
+        // an optional serial number picks the adapter, otherwise it is the first one
+        // the file name may have slashes of its own so only look before the first ':'
+        arg = argv[i];
+        adapter = 0;
+        slash = strchr(arg, '/');
+        colon = strchr(arg, ':');
+        if (slash && (!colon || slash < colon)) {
+            adapter = find_adapter(arg, slash - arg);
+            if (adapter < 0) {
+                printf("No CP2112 with serial number '%.*s'.\n", (int)(slash - arg), arg);
+                continue;
+            }
+            arg = slash + 1;
         }
 
-        res = sscanf(argv[i], "*-%x-%c:%u:%ms", &address, &mode, &duration, &name);
+        res = sscanf(arg, "*-%x-%c:%u:%ms", &address, &mode, &duration, &name);
         if (res == 4) {
             channel = MAIN_CHANNEL;
+        } else if (!strncmp(arg, "0x", 2)) {
+            channel = tca9548a_parse_path(&adapters[adapter].mux, arg, &rest);
+            if (channel < 0) {
+                printf("Multiplexer path in '%s' can't be used.\n", argv[i]);
+                continue;
+            }
+            res = sscanf(rest, "-%x-%c:%u:%ms", &address, &mode, &duration, &name);
+            if (res != 4) {
+                printf("Could not parse '%s'\n", argv[i]);
+                continue;
+            }
         } else {
-            res = sscanf(argv[i], "%u-%x-%c:%u:%ms", &channel, &address, &mode, &duration, &name);
+            res = sscanf(arg, "%u-%x-%c:%u:%ms", &channel, &address, &mode, &duration, &name);
             if (res == 5) {
                 if (channel<0 || channel>7) {
                     printf("Channel '%i' outside of 0-7 range.\n", channel);
@@ -390,20 +982,21 @@ int parse_args(struct sensor_state sensors[MAX_SENSORS], int argc, char *argv[])
             continue;
         }
         if (duration < 1) {
-            if (channel == MAIN_CHANNEL) {
-                printf("Sensor '*-0x%X-%c' duration set to 1 instead of %i.\n", address, mode, duration);
-            } else {
-                printf("Sensor '%i-0x%X-%c' duration set to 1 instead of %i.\n", channel, mode, address, duration);
-            }
+            printf("Sensor '%.*s' duration set to 1 instead of %i.\n", (int)(strchr(arg, ':') - arg), arg, duration);
             duration = 1;
         }
-        sensors[count].channel = channel;
-        sensors[count].address = address;
-        sensors[count].mode = mode;
-        sensors[count].report_interval = duration;
-        sensors[count].file_name = name;
-        //sensors[count].next_report_time = time(NULL) + duration;
-        sensors[count].next_report_time = (1 + t/duration) * duration;
+        sensor = add_sensor(sensors);
+        if (sensor == NULL) {
+            printf("Out of memory for '%s'.\n", argv[i]);
+            continue;
+        }
+        sensor->adapter = adapter;
+        sensor->channel = channel;
+        sensor->address = address;
+        sensor->mode = mode;
+        sensor->report_interval = duration;
+        sensor->file_name = name;
+        sensor->next_report_time = next_boundary(duration);
         count++;
     }
     return count;
@@ -428,83 +1021,978 @@ int probe_address(hid_device *handle, int address)
     return END_SENSOR_LIST;
 }
 
-int tca9548a_scan(hid_device *handle)
+int driver_address(int address)
 {
-    int address, r;
-    for (address=1; address<=127; address++) {
-        r = tca9548a_check(handle, address, false);
-        if (r) {
-            return address;
-        }
+    // whether any driver normally looks for its chip at the address
+    return has_address(address, tca9548a_addresses) || has_address(address, veml7700_addresses)
+        || has_address(address, ltr390uv_addresses) || has_address(address, mlx90614_addresses);
+}
+
+int identify(hid_device *handle, int address)
+{
+    // probe_address() only asks the chips that normally live at the address
+    // anything else that acked gets every sensor's id check before it is called unknown
+    // a forced TCA9548A check would pass for anything that acks, so that one isn't tried
+    int r = probe_address(handle, address);
+    if (r != END_SENSOR_LIST) {
+        return r;
     }
-    return -1;
+    if (veml7700_check(handle, address, true)) {
+        return VEML7700;
+    }
+    if (ltr390uv_check(handle, address, true)) {
+        return LTR390UV;
+    }
+    if (mlx90614_check(handle, address, true)) {
+        return MLX90614;
+    }
+    return END_SENSOR_LIST;
+}
+
+int verify_chip(hid_device *handle, int hw, int address)
+{
+    // one id check for a chip that is already known to be there
+    switch (hw) {
+        case TCA9548A:
+            return tca9548a_check(handle, address, false);
+        case VEML7700:
+            return veml7700_check(handle, address, true);
+        case LTR390UV:
+            return ltr390uv_check(handle, address, true);
+        case MLX90614:
+            return mlx90614_check(handle, address, true);
+    }
+    return false;
 }
 
-int perform_scan(hid_device *handle)
+int perform_scan(struct adapter *adapter, FILE *cache, int sweep_all)
 {
-    int enable, address, r;
-    int main_bus[128];
-    char *sensor_options[4];
+    // the main bus, then every channel of every multiplexer including cascaded ones found along the way
+    // each leaf gets a quick ack sweep and only the addresses that answered are identified
+    // the sweep covers the addresses the drivers use, or every usable one with sweep_all
+    // the results are also written to the --cache file when there is one
+    hid_device *handle = adapter->handle;
+    struct tca9548a_tree *tree = &adapter->mux;
+    int leaf, up, seen, address, r, m, ch;
+    char found[BUS_SEGMENTS][128];  // what answered on each leaf, so it isn't listed again further down
+    char name[TCA9548A_NAME];
+    char *sensor_options[5];
     sensor_options[TCA9548A] = tca9548a_mode_help;
     sensor_options[VEML7700] = veml7700_mode_help;
     sensor_options[LTR390UV] = ltr390uv_mode_help;
     sensor_options[MLX90614] = mlx90614_mode_help;
-    printf("Scanning for devices....\n");
-    for (enable=-1; enable<=7; enable++) {
-        r = channel_select(handle, enable);
-        for (address=1; address<=127; address++) {
-            if (enable != MAIN_CHANNEL && main_bus[address] != END_SENSOR_LIST) {
+    sensor_options[END_SENSOR_LIST] = "Not a supported device.";
+    memset(found, 0, sizeof(found));
+    printf("Scanning for devices on %s....\n", adapter->serial);
+    for (m=0; m<tree->mux_count; m++) {
+        for (ch=0; ch<8; ch++) {
+            tca9548a_add_leaf(tree, m, ch);
+        }
+    }
+    for (leaf=-1; leaf<tree->leaf_count; leaf++) {
+        if (leaf >= 0 && tree->leaves[leaf].mux < 0) {
+            continue;
+        }
+        if (channel_select(adapter, leaf) < 0) {
+            continue;
+        }
+        for (address=SCAN_FIRST; address<=SCAN_LAST; address++) {
+            // anything further up is connected here too
+            seen = 0;
+            for (up=leaf; up>=0 && !seen; ) {
+                up = tree->muxes[tree->leaves[up].mux].parent;
+                seen = found[up + 1][address];
+            }
+            if (seen || (!sweep_all && !driver_address(address)) || !i2c_ack(handle, address)) {
                 continue;
             }
-            r = probe_address(handle, address);
-            if (enable == MAIN_CHANNEL) {
-                main_bus[address] = r;
+            found[leaf + 1][address] = 1;
+        }
+        for (address=SCAN_FIRST; address<=SCAN_LAST; address++) {
+            if (!found[leaf + 1][address]) {
+                continue;
+            }
+            r = identify(handle, address);
+            if (r == TCA9548A && leaf >= 0) {
+                m = tca9548a_add_mux(tree, leaf, address);
+                for (ch=0; m>=0 && ch<8; ch++) {
+                    tca9548a_add_leaf(tree, m, ch);
+                }
             }
-            if (r != END_SENSOR_LIST) {
-                // it would be nice if this also got a reading from each sensor
-                printf("%c-0x%X = %s    %s\n", pretty_channel(enable), address, device_names[r], sensor_options[r]);
+            tca9548a_leaf_name(tree, leaf, name);
+            // it would be nice if this also got a reading from each sensor
+            if (adapter_count > 1) {
+                printf("%s/", adapter->serial);
+            }
+            printf("%s-0x%X = %s    %s\n", name, address, device_names[r], sensor_options[r]);
+            if (cache) {
+                fprintf(cache, "%s\t%s\t0x%X\t%s\n", adapter->serial, name, address, device_names[r]);
             }
         }
     }
     return 0;
 }
 
-int main(int argc, char *argv[])
+int cached_chip(char *cache_name, struct adapter *adapter, int channel, int address)
 {
-    //(void)argc;
-    //(void)argv;
-    int i, res, total_channels, err;
-    hid_device *handle;
+    // what the last --scan found at this spot, END_SENSOR_LIST when it doesn't say
+    FILE *f;
+    char line[128], serial[32], leaf[TCA9548A_NAME], chip[20], name[TCA9548A_NAME];
+    int a, i, hw = END_SENSOR_LIST;
+    if (cache_name == NULL) {
+        return hw;
+    }
+    f = fopen(cache_name, "r");
+    if (f == NULL) {
+        return hw;
+    }
+    tca9548a_leaf_name(&adapter->mux, channel, name);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%31s %31s %x %19s", serial, leaf, &a, chip) != 4) {
+            continue;
+        }
+        if (a != address || strcmp(serial, adapter->serial) || strcmp(leaf, name)) {
+            continue;
+        }
+        for (i=0; i<END_SENSOR_LIST; i++) {
+            if (!strcmp(chip, device_names[i])) {
+                hw = i;
+            }
+        }
+    }
+    fclose(f);
+    return hw;
+}
+
+int driver_read(hid_device *handle, struct sensor_state *sensor)
+{
+    // 0 for a new sample, 1 when there was nothing to sample, negative on failure
+    // a failure leaves the driver safe to call again right away
+    int res = -1;
+    switch (sensor->hw) {
+        case VEML7700:
+            res = veml7700_read(handle, &sensor->veml7700_sensor);
+            break;
+        case LTR390UV:
+            res = ltr390uv_read(handle, &sensor->ltr390uv_sensor);
+            break;
+        case MLX90614:
+            res = mlx90614_read(handle, &sensor->mlx90614_sensor);
+            break;
+    }
+    return res;
+}
+
+int driver_start(hid_device *handle, struct sensor_state *sensor, int shared)
+{
+    // restarts the conversion and sets wait_until to when it is done, for --sync
+    // shared when more than one multiplexer channel is switched on, writes only
+    switch (sensor->hw) {
+        case VEML7700:
+            return veml7700_start(handle, &sensor->veml7700_sensor);
+        case LTR390UV:
+            return ltr390uv_start(handle, &sensor->ltr390uv_sensor, shared);
+        case MLX90614:
+            return mlx90614_start(handle, &sensor->mlx90614_sensor);
+    }
+    return -1;
+}
+
+int sensor_check(hid_device *handle, struct sensor_state *sensor)
+{
+    // reads the sensor's ID, true when it is right
+    switch (sensor->hw) {
+        case VEML7700:
+            return veml7700_check(handle, sensor->address, true);
+        case LTR390UV:
+            return ltr390uv_check(handle, sensor->address, true);
+        case MLX90614:
+            return mlx90614_check(handle, sensor->address, true);
+    }
+    return false;
+}
+
+int calibrate_sensor(struct adapter *adapter, struct sensor_state *sensor)
+{
+    // finds the fastest clock where every ID read comes back right
+    // a channel shared by several sensors ends up at the slowest of them
+    // returns the speed, or -1 when none worked and the channel stays where the other sensors on it left it
+    int i, n;
+    int segment = sensor->channel + 1;
+    int settled = adapter->speeds[segment];
+    int ceiling = settled ? settled : calibrate_speeds[0];
+    for (i=0; calibrate_speeds[i]; i++) {
+        if (calibrate_speeds[i] > ceiling) {
+            continue;
+        }
+        adapter->speeds[segment] = calibrate_speeds[i];
+        if (channel_select(adapter, sensor->channel) < 0) {
+            cancel_transfer(adapter->handle);
+            continue;
+        }
+        for (n=0; n<CALIBRATE_READS; n++) {
+            if (!sensor_check(adapter->handle, sensor)) {
+                break;
+            }
+        }
+        if (n == CALIBRATE_READS) {
+            return calibrate_speeds[i];
+        }
+        cancel_transfer(adapter->handle);
+    }
+    adapter->speeds[segment] = settled;
+    channel_speed(adapter, sensor->channel);
+    return -1;
+}
 
-    struct sensor_state sensors[MAX_SENSORS];
+int calibrate_channels(struct sensor_table *sensors)
+{
+    struct adapter *adapter;
     struct sensor_state *sensor;
-    struct timespec ts_sensor, ts_pass;
-    struct timespec ts_io_1, ts_io_2;
+    int i, seg;
+    char name[TCA9548A_NAME];
+    printf("Calibrating I2C clocks....\n");
+    for (i=0; i<sensors->count; i++) {
+        sensor = sensors->list[i];
+        if (sensor->channel == DUMMY_CHANNEL || sensor->hw == END_SENSOR_LIST) {
+            continue;
+        }
+        adapter = &adapters[sensor->adapter];
+        if (calibrate_sensor(adapter, sensor) < 0) {
+            seg = sensor->channel + 1;
+            printf("No reliable clock for %s-0x%X, it stays at %ikHz.\n", device_names[sensor->hw], sensor->address,
+                (adapter->speeds[seg] ? adapter->speeds[seg] : adapter->speed) / 1000);
+        }
+    }
+    for (i=0; i<adapter_count; i++) {
+        adapter = &adapters[i];
+        for (seg=0; seg<BUS_SEGMENTS; seg++) {
+            if (!adapter->speeds[seg]) {
+                continue;
+            }
+            if (adapter_count > 1) {
+                printf("%s/", adapter->serial);
+            }
+            printf("%s: %ikHz\n", tca9548a_leaf_name(&adapter->mux, seg - 1, name), adapter->speeds[seg] / 1000);
+        }
+        channel_select(adapter, NO_CHANNEL);
+    }
+    return 0;
+}
 
-    if (argc == 1) {
-        return show_help();
+int prepare_sensor(struct sensor_state *sensor, int hw)
+{
+    // hooks the sensor up to its driver once the chip is known
+    // returns -1 when the mode letters don't suit the chip
+    int err = 0;
+    sensor->hw = hw;
+    switch (hw) {
+        case VEML7700:
+            if (veml7700_process_mode(&sensor->veml7700_sensor, sensor->mode)) {
+                printf("%s\n", veml7700_mode_help);
+                err = -1;
+            }
+            sensor->wait_until = &sensor->veml7700_sensor.wait_until;
+            break;
+        case LTR390UV:
+            if (ltr390uv_process_mode(&sensor->ltr390uv_sensor, sensor->mode)) {
+                printf("%s\n", ltr390uv_mode_help);
+                err = -1;
+            }
+            sensor->wait_until = &sensor->ltr390uv_sensor.wait_until;
+            break;
+        case MLX90614:
+            sensor->mlx90614_sensor.address = sensor->address;
+            if (mlx90614_process_mode(&sensor->mlx90614_sensor, sensor->mode)) {
+                printf("%s\n", mlx90614_mode_help);
+                err = -1;
+            }
+            sensor->wait_until = &sensor->mlx90614_sensor.wait_until;
+            break;
+        default:
+            err = -1;
+            break;
     }
-    if (has_arg("-h", argc, argv) || has_arg("--help", argc, argv)) {
-        return show_help();
+    return err;
+}
+
+int configure_sensor(struct adapter *adapter, struct sensor_state *sensor, int force)
+{
+    // the setup writes, force sends them even when the shadow map already has them
+    hid_device *handle = adapter->handle;
+    int res = 0;
+    channel_select(adapter, sensor->channel);
+    switch (sensor->hw) {
+        case VEML7700:
+            res = veml7700_setup(handle, &sensor->veml7700_sensor, force);
+            veml7700_tick(&sensor->veml7700_sensor);
+            if (force) {
+                tick_sleep_us(2500);
+            }
+            break;
+        case LTR390UV:
+            res = setup_ltr390uv(handle, &sensor->ltr390uv_sensor, force);
+            break;
+        case MLX90614:
+            break;
+    }
+    if (res < 0) {
+        channel_select(adapter, NO_CHANNEL);
+        sensor->error = "bad conf";
+        sensor->errors += 1;
     }
+    return res;
+}
 
-    if (hid_version()->major == HID_API_VERSION_MAJOR && hid_version()->minor == HID_API_VERSION_MINOR && hid_version()->patch == HID_API_VERSION_PATCH) {
+int same_setup(struct sensor_state *a, struct sensor_state *b)
+{
+    // whether two sensors get exactly the same setup writes
+    struct ltr390uv_state *la = &a->ltr390uv_sensor, *lb = &b->ltr390uv_sensor;
+    if (a->hw != b->hw || a->adapter != b->adapter || a->address != b->address) {
+        return false;
     }
-    else {
-        printf("Warning: compile-time version is different than runtime version of hidapi.\n\n");
+    switch (a->hw) {
+        case VEML7700:
+            return a->veml7700_sensor.integration == b->veml7700_sensor.integration
+                && a->veml7700_sensor.gain == b->veml7700_sensor.gain;
+        case LTR390UV:
+            return la->uv_mode == lb->uv_mode
+                && la->als_gain == lb->als_gain && la->als_integration == lb->als_integration && la->als_rate == lb->als_rate
+                && la->uvs_gain == lb->uvs_gain && la->uvs_integration == lb->uvs_integration && la->uvs_rate == lb->uvs_rate;
     }
+    return false;
+}
 
-    if (hid_init()) {
-        printf("Unable to initialize USB.\n");
+int broadcast_setup(struct sensor_table *sensors, int *shared)
+{
+    // identical sensors on different channels of one multiplexer get their setup written once,
+    // with all of their channels switched on together
+    // their shadow maps then already hold the settings, so the normal setup of each one writes nothing
+    // marks the sensors that were set up this way and returns how many groups there were
+    struct sensor_state *a, *b;
+    struct tca9548a_tree *tree;
+    int members[TCA9548A_CHANNELS];  // the other channels of the group
+    int i, j, n, mask, groups = 0, res;
+    for (i=0; i<sensors->count; i++) {
+        shared[i] = 0;
+    }
+    for (i=0; i<sensors->count; i++) {
+        a = sensors->list[i];
+        if (a->channel < 0 || shared[i] || (a->hw != VEML7700 && a->hw != LTR390UV)) {
+            continue;
+        }
+        tree = &adapters[a->adapter].mux;
+        mask = 1 << tree->leaves[a->channel].channel;
+        n = 0;
+        for (j=i+1; j<sensors->count; j++) {
+            b = sensors->list[j];
+            if (b->channel < 0 || shared[j] || !same_setup(a, b)) {
+                continue;
+            }
+            if (tree->leaves[b->channel].mux != tree->leaves[a->channel].mux || mask & (1 << tree->leaves[b->channel].channel)) {
+                continue;
+            }
+            mask |= 1 << tree->leaves[b->channel].channel;
+            members[n++] = j;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (tca9548a_select_mask(adapters[a->adapter].handle, tree, a->channel, mask) < 0) {
+            continue;
+        }
+        channel_speed(&adapters[a->adapter], a->channel);
+        if (a->hw == VEML7700) {
+            res = veml7700_setup(adapters[a->adapter].handle, &a->veml7700_sensor, 1);
+        } else {
+            res = setup_ltr390uv(adapters[a->adapter].handle, &a->ltr390uv_sensor, 1);
+        }
+        if (res < 0) {
+            continue;
+        }
+        shared[i] = 1;
+        for (j=0; j<n; j++) {
+            b = sensors->list[members[j]];
+            b->veml7700_sensor.regs = a->veml7700_sensor.regs;
+            b->ltr390uv_sensor.regs = a->ltr390uv_sensor.regs;
+            shared[members[j]] = 1;
+        }
+        groups++;
+        if (a->hw == VEML7700) {
+            tick_sleep_us(2500);
+        }
+    }
+    return groups;
+}
+
+int sensor_read(hid_device *handle, struct sensor_state *sensor)
+{
+    // one pass, with the retry policy applied
+    int res, attempt;
+    for (attempt=0; ; attempt++) {
+        res = driver_read(handle, sensor);
+        if (res >= 0) {
+            retry_success(&sensor->retry);
+            return res;
+        }
+        if (!retry_again(&sensor->retry, attempt)) {
+            break;
+        }
+        i2c_count_retry(handle);
+    }
+    retry_failed(&sensor->retry, sensor->wait_until);
+    return res;
+}
+
+int hotplug_address(int spot)
+{
+    // the spot'th address that a supported sensor normally lives at, -1 past the last one
+    const int *lists[] = {veml7700_addresses, ltr390uv_addresses, mlx90614_addresses, NULL};
+    int i, j;
+    for (i=0; lists[i]; i++) {
+        for (j=0; lists[i][j]!=END_LIST; j++) {
+            if (lists[i][j] != ANY_ADDRESS && spot-- == 0) {
+                return lists[i][j];
+            }
+        }
+    }
+    return -1;
+}
+
+char *hotplug_name(char *out, struct adapter *io, int leaf, int address, int hw)
+{
+    // the --hotplug template with %s for the serial number, %c the channel, %a the address and %d the device
+    char chan[TCA9548A_NAME];
+    char *p;
+    int n = 0;
+    tca9548a_leaf_name(&io->mux, leaf, chan);
+    for (p=hotplug_template; *p && n<HOTPLUG_NAME-1; p++) {
+        if (*p != '%' || p[1] == '\0') {
+            out[n++] = *p;
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 's':
+                n += snprintf(out + n, HOTPLUG_NAME - n, "%s", io->serial);
+                break;
+            case 'c':
+                n += snprintf(out + n, HOTPLUG_NAME - n, "%s", chan);
+                break;
+            case 'a':
+                n += snprintf(out + n, HOTPLUG_NAME - n, "0x%X", address);
+                break;
+            case 'd':
+                n += snprintf(out + n, HOTPLUG_NAME - n, "%s", device_names[hw]);
+                break;
+            default:
+                out[n++] = *p;
+                break;
+        }
+    }
+    out[n < HOTPLUG_NAME ? n : HOTPLUG_NAME - 1] = '\0';
+    return out;
+}
+
+int hotplug_attach(struct adapter *io, int leaf, int address, int hw)
+{
+    // a new sensor starts logging everything it has
+    // it is filled in before it goes into the table, which the other threads only look at under the lock
+    // one that doesn't fit in the --budget waits offline for the rescan to try it again
+    // returns its index
+    struct sensor_state *sensor;
+    char name[HOTPLUG_NAME];
+    int i;
+    sensor = new_sensor();
+    if (sensor == NULL) {
+        return -1;
+    }
+    sensor->adapter = io->index;
+    sensor->channel = leaf;
+    sensor->address = address;
+    sensor->mode = '*';
+    sensor->report_interval = hotplug_interval;
+    sensor->next_report_time = next_boundary(hotplug_interval);
+    sensor->file_name = strdup(hotplug_name(name, io, leaf, address, hw));
+    prepare_sensor(sensor, hw);
+    configure_sensor(io, sensor, 1);
+    if (!plan_admits(io, sensor)) {
+        sensor->offline = 1;
+        sensor->error = "over budget";
+    }
+    pthread_mutex_lock(&hotplug_lock);
+    i = table_append(io->sensors, sensor);
+    pthread_mutex_unlock(&hotplug_lock);
+    if (i < 0) {
+        free(sensor);
         return -1;
     }
+    if (sensor->offline) {
+        pthread_mutex_lock(&stats_lock);
+        printf("\n%s has no room in the --budget for %s, it waits for the load to drop.\n", io->serial, sensor->file_name);
+        pthread_mutex_unlock(&stats_lock);
+        return i;
+    }
+    schedule_add(io, sensor);
+    plan_sensor(io, sensor);
+    return i;
+}
 
-    // serial number could be a way to handle multiple boards
-    handle = hid_open(CP2112_VID, CP2112_PID, NULL);
-    if (!handle) {
-        printf("Unable to open CP2112.\n");
+int hotplug_online(struct adapter *io, struct sensor_state *sensor)
+{
+    // an offline sensor answered again, so it gets its settings back and a fresh interval
+    // unless there is no room for it in the --budget yet
+    int res;
+    if (!plan_admits(io, sensor)) {
+        sensor->error = "over budget";
+        return 0;
+    }
+    tick_now(sensor->wait_until);
+    retry_success(&sensor->retry);
+    sensor->offline = 0;
+    sensor->error = "";
+    sensor->next_report_time = next_boundary(sensor->report_interval);
+    configure_sensor(io, sensor, 1);
+    res = schedule_add(io, sensor);
+    plan_sensor(io, sensor);
+    return res;
+}
+
+int hotplug_step(struct adapter *io)
+{
+    // one probe of the background rescan, at the next address on the next leaf that could have something new
+    // spots with a working sensor, or that see a known sensor further up, are passed over without touching the bus
+    // every probe starts with an ack, so an empty spot costs one short read and leaves the shadow maps alone
+    // returns 1 when the bus was used
+    struct tca9548a_tree *tree = &io->mux;
+    struct sensor_state *sensor, *s;
+    int i, n, spots, leaf, address, hw, shadowed;
+    spots = 0;
+    while (hotplug_address(spots) >= 0) {
+        spots++;
+    }
+    // one lap at most, the extra spot of each leaf is where it moves on to the next
+    for (n=0; n<(tree->leaf_count+1)*(spots+1); n++) {
+        address = hotplug_address(io->hotplug_spot++);
+        if (address < 0) {
+            io->hotplug_spot = 0;
+            do {
+                io->hotplug_leaf = io->hotplug_leaf + 1 < tree->leaf_count ? io->hotplug_leaf + 1 : -1;
+            } while (io->hotplug_leaf >= 0 && tree->leaves[io->hotplug_leaf].mux < 0);
+            continue;
+        }
+        leaf = io->hotplug_leaf;
+        sensor = NULL;
+        shadowed = 0;
+        // where a sensor is never changes, so the other threads' entries are safe to read
+        pthread_mutex_lock(&hotplug_lock);
+        for (i=0; i<io->sensors->count; i++) {
+            s = io->sensors->list[i];
+            if (s->adapter != io->index || s->channel == DUMMY_CHANNEL || s->address != address) {
+                continue;
+            }
+            if (s->channel == leaf) {
+                sensor = s;
+            } else if (tca9548a_exposes(tree, s->channel, leaf)) {
+                shadowed = 1;
+            }
+        }
+        pthread_mutex_unlock(&hotplug_lock);
+        if (shadowed || (sensor && !sensor->offline)) {
+            continue;
+        }
+        if (channel_select(io, leaf) < 0 || !i2c_ack(io->handle, address)) {
+            return 1;
+        }
+        if (sensor) {
+            if (verify_chip(io->handle, sensor->hw, address)) {
+                hotplug_online(io, sensor);
+            }
+            return 1;
+        }
+        hw = probe_address(io->handle, address);
+        if (hw != END_SENSOR_LIST && hw != TCA9548A) {
+            hotplug_attach(io, leaf, address, hw);
+        }
         return 1;
     }
+    return 0;
+}
+
+int run_sensor(struct adapter *io, struct sensor_state *sensor, long *read_ns)
+{
+    // one read with its bookkeeping, however it was scheduled
+    struct timespec start;
+    long switches;
+    int res;
+    tick_now(&start);
+    switches = io->mux.switches;
+    channel_select(io, sensor->channel);
+    sensor->switches += io->mux.switches - switches;
+    res = sensor_read(io->handle, sensor);
+    *read_ns = tick_elapsed_ns(&start);
+    sensor->read_ns += *read_ns;
+    io->reads++;
+    io->busy_ns += *read_ns;
+    if (res == 0) {
+        sensor->readings++;
+    }
+    if (res < 0) {
+        //channel_select(handle, NO_CHANNEL);
+        sensor->error = sensor->retry.open ? "circuit open" : "bad read";
+        sensor->errors++;
+        // with --hotplug it is left to the rescan, and what it had so far is logged now
+        if (hotplug_template && sensor->retry.open) {
+            sensor->offline = 1;
+            sensor->error = "offline";
+        }
+    }
+    return res;
+}
+
+int post_completion(struct adapter *io, struct sensor_state *sensor, int res, long read_ns, time_t log_time)
+{
+    // hands a snapshot to the main thread, a log_time closes out the report interval
+    // when the ring is full a status update is simply lost
+    // and an interval keeps accumulating until its row gets through
+    struct completion c;
+    c.sensor = sensor->index;
+    c.result = res;
+    c.read_ns = read_ns;
+    tick_now(&c.finished);
+    c.polls = *i2c_polls(io->handle);
+    c.load = io->load;
+    c.log_time = log_time;
+    c.snapshot = *sensor;
+    if (ring_push(&io->completions, &c)) {
+        return -1;
+    }
+    if (log_time) {
+        end_interval(sensor);
+    }
+    return 0;
+}
+
+void *acquire(void *arg)
+{
+    // the only thing that touches the hid_device while data is being collected
+    // results go out through the completion ring so slow disks and terminals can't hold it up
+    struct adapter *io = arg;
+    struct sensor_state *sensor;
+    struct timespec now, ts_pass, deadline;
+    time_t t, log_time;
+    long read_ns, late;
+    int res;
+
+    ts_pass.tv_sec = 0L;
+    tick_now(&io->started);
+    while (!force_exit) {
+        if (io->stats_seen != stats_requested) {
+            io->stats_seen = stats_requested;
+            dump_stats(io);
+        }
+        // the one clock read that the scheduling goes by
+        tick_now(&now);
+        if (ts_pass.tv_sec == 0L) {
+            ts_pass = now;
+        }
+        sensor = next_sensor2(io, &now, &deadline);
+        // the rescan only gets gaps that are long enough to not make anything late
+        if (sensor == NULL && hotplug_template && tick_difference(&deadline, &now) >= HOTPLUG_IDLE_MS
+            && tick_difference(&now, &io->hotplug_next) >= 0) {
+            hotplug_step(io);
+            io->hotplug_next = now;
+            tick_increment(&io->hotplug_next, HOTPLUG_PERIOD_MS);
+            continue;
+        }
+        if (sensor == NULL) {
+            tick_sleep_until(&deadline);
+            continue;
+        }
+
+        // how far behind it ran, affinity only ever picks sensors that are due
+        late = tick_difference_us(&now, sensor->wait_until);
+        record_latency(&io->lateness, late > 0 ? late : 0);
+        res = run_sensor(io, sensor, &read_ns);
+        sensor->pass_ns += tick_elapsed_ns(&ts_pass);
+        ts_pass.tv_sec = 0L;
+        schedule_done(io, sensor, !sensor->offline);
+        plan_sensor(io, sensor);
+
+        log_time = 0;
+        t = tick_seconds();
+        if ((res >= 0 && sensor->next_report_time <= t) || sensor->offline) {
+            log_time = t;
+        }
+        post_completion(io, sensor, res, read_ns, log_time);
+    }
+    tick_detach();
+    return NULL;
+}
+
+int sync_waiting(struct sensor_state *sensor)
+{
+    // a sensor that is backing off after failed reads sits epochs out until its time comes
+    return sensor->retry.failures && !tick_ready(sensor->wait_until);
+}
+
+int sync_start(struct adapter *io, long long epoch, struct timespec *ready)
+{
+    // starts a conversion on every sensor of the adapter in one burst, a channel at a time
+    // identical sensors on different channels of one multiplexer share the writes, like in broadcast_setup()
+    // ready gets when the slowest one is done, returns how many were started
+    struct tca9548a_tree *tree = &io->mux;
+    struct segment *seg, *other;
+    struct sensor_state *a, *b;
+    struct sensor_state *members[TCA9548A_CHANNELS];
+    int s, t, i, j, n, mask, res, started = 0;
+    tick_now(ready);
+    for (s=0; s<BUS_SEGMENTS; s++) {
+        seg = &io->segments[s];
+        for (i=0; i<seg->sensors.count; i++) {
+            a = seg->sensors.entries[i].item;
+            if (a->sync_epoch == epoch || sync_waiting(a)) {
+                continue;
+            }
+            n = 0;
+            mask = 0;
+            if (a->channel >= 0 && (a->hw == VEML7700 || a->hw == LTR390UV)) {
+                mask = 1 << tree->leaves[a->channel].channel;
+                // later segments are all multiplexer leaves
+                for (t=s+1; t<BUS_SEGMENTS; t++) {
+                    other = &io->segments[t];
+                    for (j=0; j<other->sensors.count; j++) {
+                        b = other->sensors.entries[j].item;
+                        if (b->sync_epoch == epoch || sync_waiting(b) || !same_setup(a, b)) {
+                            continue;
+                        }
+                        if (tree->leaves[b->channel].mux != tree->leaves[a->channel].mux || mask & (1 << tree->leaves[b->channel].channel)) {
+                            continue;
+                        }
+                        mask |= 1 << tree->leaves[b->channel].channel;
+                        members[n++] = b;
+                    }
+                }
+            }
+            if (n && tca9548a_select_mask(io->handle, tree, a->channel, mask) == 0) {
+                channel_speed(io, a->channel);
+            } else {
+                n = 0;
+                if (channel_select(io, a->channel) < 0) {
+                    continue;
+                }
+            }
+            // the writes go through a's shadow map, one that doesn't speak for every member
+            // could skip a write that some member still needs
+            for (j=0; j<n; j++) {
+                b = members[j];
+                if (!shadow_same(&a->veml7700_sensor.regs, &b->veml7700_sensor.regs) || !shadow_same(&a->ltr390uv_sensor.regs, &b->ltr390uv_sensor.regs)) {
+                    shadow_invalidate(&a->veml7700_sensor.regs);
+                    shadow_invalidate(&a->ltr390uv_sensor.regs);
+                }
+            }
+            res = driver_start(io->handle, a, n > 0);
+            if (res < 0) {
+                a->error = "bad start";
+                a->errors++;
+                // the members may have got some of the writes
+                for (j=0; j<n; j++) {
+                    shadow_invalidate(&members[j]->veml7700_sensor.regs);
+                    shadow_invalidate(&members[j]->ltr390uv_sensor.regs);
+                }
+                continue;
+            }
+            a->sync_epoch = epoch;
+            for (j=0; j<n; j++) {
+                b = members[j];
+                b->veml7700_sensor.regs = a->veml7700_sensor.regs;
+                b->veml7700_sensor.stale = 0;
+                b->ltr390uv_sensor.regs = a->ltr390uv_sensor.regs;
+                *b->wait_until = *a->wait_until;
+                b->sync_epoch = epoch;
+            }
+            started += n + 1;
+            if (tick_difference(a->wait_until, ready) > 0) {
+                *ready = *a->wait_until;
+            }
+        }
+    }
+    return started;
+}
+
+int sync_collect(struct adapter *io, long long epoch, struct timespec *start, struct timespec *ts_pass)
+{
+    // reads every sensor that was started for the epoch, a channel at a time
+    // a report interval closes before the first epoch that starts after it,
+    // so files with the same integrate_seconds have the same epochs in each row
+    // returns how many were read
+    struct segment *seg;
+    struct sensor_state *sensor;
+    long read_ns;
+    int s, i, res, n = 0, offline = 0;
+    for (s=0; s<BUS_SEGMENTS && !force_exit; s++) {
+        seg = &io->segments[s];
+        for (i=0; i<seg->sensors.count; i++) {
+            sensor = seg->sensors.entries[i].item;
+            if (sensor->sync_epoch != epoch) {
+                continue;
+            }
+            // an interval without samples, from a slow start or a long backoff, is skipped over
+            while (sensor->first_epoch == 0 && start->tv_sec >= sensor->next_report_time) {
+                sensor->next_report_time += sensor->report_interval;
+            }
+            if (start->tv_sec >= sensor->next_report_time) {
+                post_completion(io, sensor, 1, 0L, start->tv_sec);
+            }
+            res = run_sensor(io, sensor, &read_ns);
+            sensor->pass_ns += tick_elapsed_ns(ts_pass);
+            tick_now(ts_pass);
+            if (res == 0) {
+                if (sensor->first_epoch == 0) {
+                    sensor->first_epoch = epoch;
+                }
+                sensor->last_epoch = epoch;
+            }
+            offline += sensor->offline;
+            plan_sensor(io, sensor);
+            post_completion(io, sensor, res, read_ns, sensor->offline ? tick_seconds() : 0);
+            n++;
+        }
+    }
+    // autoscaling changes the conversion times, and with them how many epochs a sweep takes
+    plan_sync(io);
+    // taken out afterwards, removing moves the others around in their segment
+    for (s=0; s<BUS_SEGMENTS && offline; s++) {
+        seg = &io->segments[s];
+        i = 0;
+        while (i < seg->sensors.count) {
+            sensor = seg->sensors.entries[i].item;
+            if (!sensor->offline) {
+                i++;
+                continue;
+            }
+            schedule_remove(io, sensor);
+            offline--;
+            i = 0;
+        }
+    }
+    return n;
+}
+
+void *acquire_sync(void *arg)
+{
+    // --sync, all of the adapter's conversions start in one burst at the top of each epoch
+    // and are read in one sweep once the slowest is done
+    // an epoch that runs long makes the next one start at the following boundary
+    struct adapter *io = arg;
+    struct timespec start, ready, now, ts_pass;
+    long long epoch = 0;
+    tick_now(&ts_pass);
+    io->started = ts_pass;
+    while (!force_exit) {
+        if (io->stats_seen != stats_requested) {
+            io->stats_seen = stats_requested;
+            dump_stats(io);
+        }
+        epoch = tick_next_epoch(sync_ms, epoch, &start);
+        // the rescan gets the gap before the epoch when it is long enough
+        tick_now(&now);
+        if (hotplug_template && tick_difference(&start, &now) >= HOTPLUG_IDLE_MS
+            && tick_difference(&now, &io->hotplug_next) >= 0) {
+            hotplug_step(io);
+            io->hotplug_next = now;
+            tick_increment(&io->hotplug_next, HOTPLUG_PERIOD_MS);
+        }
+        while (!force_exit && !tick_ready(&start)) {
+            tick_sleep_until(&start);
+        }
+        if (!force_exit) {
+            record_latency(&io->lateness, tick_elapsed_ns(&start) / 1000L);
+        }
+        if (force_exit || sync_start(io, epoch, &ready) == 0) {
+            continue;
+        }
+        while (!force_exit && !tick_ready(&ready)) {
+            tick_sleep_until(&ready);
+        }
+        sync_collect(io, epoch, &start, &ts_pass);
+    }
+    tick_detach();
+    return NULL;
+}
+
+int drain_completions(struct adapter *io, struct sensor_table *shown)
+{
+    // returns how many completions were handled
+    struct completion c;
+    struct sensor_state *s;
+    int n = 0;
+    while (!ring_pop(&io->completions, &c)) {
+        // a sensor attached by --hotplug is new here too, and gets its header before its first row
+        while (c.sensor >= shown->count) {
+            if (add_sensor(shown) == NULL) {
+                break;
+            }
+        }
+        if (c.sensor >= shown->count) {
+            continue;
+        }
+        s = shown->list[c.sensor];
+        if (s->file_name == NULL && c.snapshot.file_name) {
+            maybe_header(&c.snapshot);
+        }
+        *s = c.snapshot;
+        io->polls = c.polls;
+        io->load_seen = c.load;
+        // autoscaling and --hotplug move the plan, a warning each time it goes over
+        if (c.load * 100.0 > (plan_budget ? plan_budget : PLAN_BUDGET)) {
+            if (!io->load_warned) {
+                printf("\n%s is planned at %.0f%% of its bus now.\n", io->serial, c.load * 100.0);
+            }
+            io->load_warned = 1;
+        } else {
+            io->load_warned = 0;
+        }
+        if (c.log_time) {
+            write_row(s, c.log_time);
+        }
+        n++;
+    }
+    return n;
+}
+
+int open_adapters(void)
+{
+    // every CP2112 plugged in, in enumeration order
+    // returns how many could be opened
+    struct hid_device_info *devs, *d;
+    struct adapter *adapter;
+    devs = hid_enumerate(CP2112_VID, CP2112_PID);
+    for (d=devs; d && adapter_count<MAX_ADAPTERS; d=d->next) {
+        adapter = &adapters[adapter_count];
+        memset(adapter, 0, sizeof(*adapter));
+        adapter->handle = hid_open_path(d->path);
+        if (!adapter->handle) {
+            printf("Unable to open CP2112 at %s.\n", d->path);
+            continue;
+        }
+        adapter->serial[0] = '\0';
+        if (d->serial_number) {
+            wcstombs(adapter->serial, d->serial_number, sizeof(adapter->serial) - 1);
+            adapter->serial[sizeof(adapter->serial) - 1] = '\0';
+        }
+        adapter->index = adapter_count;
+        cp2112_name(adapter->handle, adapter->serial);
+        adapter_count++;
+    }
+    hid_free_enumeration(devs);
+    return adapter_count;
+}
+
+int setup_adapter(struct adapter *adapter, int argc, char *argv[])
+{
+    hid_device *handle = adapter->handle;
+    int res;
 
     // a normal device reset isn't compatible with windows?
     // maybe cancelling is good enough
@@ -512,8 +2000,8 @@ int main(int argc, char *argv[])
 
     res = setup_gpio(handle, !has_arg("--noblink", argc, argv));
     if (res < 0) {
-        printf("Unable to configure GPIO.\n");
-        return 1;
+        printf("Unable to configure GPIO on %s.\n", adapter->serial);
+        return -1;
     }
 
     if (has_arg("--slow", argc, argv)) {
@@ -524,162 +2012,327 @@ int main(int argc, char *argv[])
         res = setup_i2c(handle, I2C_NORMAL_SPEED);
     }
     if (res < 0) {
-        printf("Unable to configure I2C.\n");
+        printf("Unable to configure I2C on %s.\n", adapter->serial);
+        return -1;
+    }
+    adapter->speed = i2c_speed(handle);
+
+    if (!has_arg("--noautosend", argc, argv) && setup_autosend(handle, 1) < 0) {
+        printf("Unable to enable autosend on %s, using forced reads.\n", adapter->serial);
+    }
+
+    // find the multiplexers and start with all of them off
+    tca9548a_tree_init(&adapter->mux);
+    tca9548a_discover(handle, &adapter->mux);
+    channel_select(adapter, NO_CHANNEL);
+    return 0;
+}
+
+int close_adapters(void)
+{
+    // cleanup() does the hidapi shutdown, so it gets the last one
+    int i;
+    for (i=0; i<adapter_count; i++) {
+        channel_select(&adapters[i], NO_CHANNEL);
+    }
+    for (i=1; i<adapter_count; i++) {
+        cp2112_forget(adapters[i].handle);
+        hid_close(adapters[i].handle);
+    }
+    if (adapter_count) {
+        return cleanup(adapters[0].handle);
+    }
+    cp2112_capture_stop();
+    hid_exit();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    //(void)argc;
+    //(void)argv;
+    int i, m, ch, res, total_channels, err, updated, pending;
+    struct timespec now, redrawn;
+    char name[TCA9548A_NAME];
+    char *cache_name;
+    FILE *cache;
+
+    struct sensor_table sensors = {NULL, 0, 0};
+    struct sensor_table shown = {NULL, 0, 0};
+    int *shared;
+    struct sensor_state *sensor;
+    struct adapter *adapter;
+
+    if (argc == 1) {
+        return show_help();
+    }
+    if (has_arg("-h", argc, argv) || has_arg("--help", argc, argv)) {
+        return show_help();
+    }
+
+    if (hid_version()->major == HID_API_VERSION_MAJOR && hid_version()->minor == HID_API_VERSION_MINOR && hid_version()->patch == HID_API_VERSION_PATCH) {
+    }
+    else {
+        printf("Warning: compile-time version is different than runtime version of hidapi.\n\n");
+    }
+
+    if (hid_init()) {
+        printf("Unable to initialize USB.\n");
+        return -1;
+    }
+
+    if (arg_value("--record=", argc, argv) && cp2112_capture(arg_value("--record=", argc, argv))) {
+        printf("Unable to write the capture file.\n");
         return 1;
     }
 
-    // find the multiplexer
-    tca9548a_device.address = tca9548a_scan(handle);
+    if (open_adapters() < 1) {
+        printf("Unable to open CP2112.\n");
+        return 1;
+    }
+    for (i=0; i<adapter_count; i++) {
+        if (setup_adapter(&adapters[i], argc, argv)) {
+            close_adapters();
+            return 1;
+        }
+    }
 
-    if (has_arg("--scan", argc, argv)) {
-        perform_scan(handle);
-        return cleanup(handle);
+    cache_name = arg_value("--cache=", argc, argv);
+    if (has_arg("--scan", argc, argv) || has_arg("--scanall", argc, argv)) {
+        cache = NULL;
+        if (cache_name) {
+            cache = fopen(cache_name, "w");
+            if (cache == NULL) {
+                printf("Unable to write the scan cache.\n");
+            }
+        }
+        for (i=0; i<adapter_count; i++) {
+            perform_scan(&adapters[i], cache, has_arg("--scanall", argc, argv));
+        }
+        if (cache) {
+            fclose(cache);
+        }
+        return close_adapters();
     }
 
-    init_status(sensors);
-    total_channels = parse_args(sensors, argc, argv);
-    if (total_channels < 1) {
+    retry_policy = default_retry_policy;
+    if (arg_value("--retry=", argc, argv) && retry_parse(&retry_policy, arg_value("--retry=", argc, argv))) {
+        printf("Bad --retry policy.\n\n");
+        close_adapters();
+        return show_help();
+    }
+    if (arg_value("--affinity=", argc, argv)) {
+        affinity_ms = atoi(arg_value("--affinity=", argc, argv));
+    }
+    if (arg_value("--sync=", argc, argv)) {
+        sync_ms = atoi(arg_value("--sync=", argc, argv));
+        if (sync_ms < 1) {
+            printf("Bad --sync epoch length.\n\n");
+            close_adapters();
+            return show_help();
+        }
+    }
+    if (arg_value("--budget=", argc, argv)) {
+        plan_budget = atoi(arg_value("--budget=", argc, argv));
+        if (plan_budget < 1) {
+            printf("Bad --budget percentage.\n\n");
+            close_adapters();
+            return show_help();
+        }
+    }
+    if (arg_value("--hotplug=", argc, argv)) {
+        hotplug_interval = atoi(arg_value("--hotplug=", argc, argv));
+        hotplug_template = strchr(arg_value("--hotplug=", argc, argv), ':');
+        if (hotplug_template == NULL || hotplug_interval < 1 || strlen(hotplug_template) < 2) {
+            printf("Bad --hotplug file template.\n\n");
+            close_adapters();
+            return show_help();
+        }
+        hotplug_template++;
+    }
+    total_channels = parse_args(&sensors, argc, argv);
+    if (total_channels < 1 && !hotplug_template) {
         printf("No inputs were specified.\n\n");
-        cleanup(handle);
+        close_adapters();
         return show_help();
     }
 
     err = 0;
     // figure out what hardware is actually at the specified location
     for (i=0; i<total_channels; i++) {
-        channel_select(handle, sensors[i].channel);
-        res = probe_address(handle, sensors[i].address);
-        sensors[i].hw = res;
-        switch (res) {
-            case VEML7700:
-                if (veml7700_process_mode(&sensors[i].veml7700_sensor, sensors[i].mode)) {
-                    printf("%s\n", veml7700_mode_help);
-                    err = 1;
-                }
-                sensors[i].wait_until = &sensors[i].veml7700_sensor.wait_until;
-                break;
-            case LTR390UV:
-                if (ltr390uv_process_mode(&sensors[i].ltr390uv_sensor, sensors[i].mode)) {
-                    printf("%s\n", ltr390uv_mode_help);
-                    err = 1;
-                }
-                sensors[i].wait_until = &sensors[i].ltr390uv_sensor.wait_until;
-                break;
-            case MLX90614:
-                sensors[i].mlx90614_sensor.address = sensors[i].address;
-                if (mlx90614_process_mode(&sensors[i].mlx90614_sensor, sensors[i].mode)) {
-                    printf("%s\n", mlx90614_mode_help);
-                    err = 1;
-                }
-                sensors[i].wait_until = &sensors[i].mlx90614_sensor.wait_until;
-                break;
-            default:
-                printf("Could not detect an i2c device at ");
-                if (sensors[i].channel == MAIN_CHANNEL) {
-                    printf("*");
-                } else {
-                    printf("%i", sensors[i].channel);
-                }
-                printf("-0x%X\n", sensors[i].address);
-                err = 1;
-                break;
+        sensor = sensors.list[i];
+        adapter = &adapters[sensor->adapter];
+        adapter->active = 1;
+        res = END_SENSOR_LIST;
+        // a multiplexer that can't be reached would leave the probe looking at the main bus
+        // whatever the scan cache knows about only has its own id checked
+        if (channel_select(adapter, sensor->channel) == 0) {
+            res = cached_chip(cache_name, adapter, sensor->channel, sensor->address);
+            if (res == END_SENSOR_LIST || !verify_chip(adapter->handle, res, sensor->address)) {
+                res = probe_address(adapter->handle, sensor->address);
+            }
+        }
+        if (res == END_SENSOR_LIST) {
+            printf("Could not detect an i2c device at ");
+            if (adapter_count > 1) {
+                printf("%s/", adapter->serial);
+            }
+            printf("%s-0x%X\n", tca9548a_leaf_name(&adapter->mux, sensor->channel, name), sensor->address);
+            err = 1;
+        } else if (prepare_sensor(sensor, res)) {
+            err = 1;
         }
         if (err) {
-            channel_select(handle, NO_CHANNEL);
-            cleanup(handle);
+            close_adapters();
             return 1;
         }
     }
 
-    for (i=0; i<MAX_SENSORS; i++) {
-        if (sensors[i].file_name) {
-            maybe_header(&sensors[i]);
-        }
+    for (i=0; i<sensors.count; i++) {
+        maybe_header(sensors.list[i]);
+    }
+
+    stats_file_name = arg_value("--stats=", argc, argv);
+    // explicit speeds turn calibration off
+    if (!has_arg("--slow", argc, argv) && !has_arg("--fast", argc, argv) && !has_arg("--nocalibrate", argc, argv)) {
+        calibrate_channels(&sensors);
     }
 
     signal(SIGINT, exit_handler);
+#ifndef _WIN32
+    signal(SIGUSR1, stats_handler);
+#endif
     printf("Press control-c at any time to stop data collection and change the channel configuration.\n");
 
     // config
-    for (i=0; i<MAX_SENSORS; i++) {
-        sensor = &sensors[i];
-        switch (sensor->hw) {
-            case VEML7700:
-                res = veml7700_setup(handle, &sensor->veml7700_sensor, 1);
-                veml7700_tick(&sensor->veml7700_sensor);
-                usleep(2500);
-                break;
-            case LTR390UV:
-                res = setup_ltr390uv(handle, &sensor->ltr390uv_sensor, 1);
-                break;
-            case MLX90614:
-                break;
-        }
-        if (res < 0) {
-            channel_select(handle, NO_CHANNEL);
-            sensor->error = "bad conf";
-            sensor->errors += 1;
-            continue;
+    shared = calloc(sensors.count + 1, sizeof(int));
+    if (shared) {
+        broadcast_setup(&sensors, shared);
+    }
+    for (i=0; i<sensors.count; i++) {
+        sensor = sensors.list[i];
+        configure_sensor(&adapters[sensor->adapter], sensor, !(shared && shared[i]));
+    }
+    free(shared);
+
+    // the rescan covers every channel of every multiplexer that is known, and every adapter
+    for (i=0; hotplug_template && i<adapter_count; i++) {
+        adapter = &adapters[i];
+        for (m=0; m<adapter->mux.mux_count; m++) {
+            for (ch=0; ch<8; ch++) {
+                tca9548a_add_leaf(&adapter->mux, m, ch);
+            }
         }
+        adapter->hotplug_leaf = -1;
+        tick_now(&adapter->hotplug_next);
+        adapter->active = 1;
     }
 
-    while (!force_exit) {
-        if (ts_pass.tv_sec == 0L) {
-            clock_gettime(CLOCK_REALTIME, &ts_pass);
+    for (i=0; i<sensors.count; i++) {
+        sensor = add_sensor(&shown);
+        if (sensor) {
+            *sensor = *sensors.list[i];
         }
-        i = next_sensor2(sensors);
-        if (i<0) {
-            usleep(-i * 1000);
-            continue;
+    }
+    for (i=0; i<adapter_count; i++) {
+        schedule_init(&adapters[i]);
+    }
+    for (i=0; i<sensors.count; i++) {
+        sensor = sensors.list[i];
+        if (!sensor->zero_halt) {
+            schedule_add(&adapters[sensor->adapter], sensor);
         }
+    }
 
-        sensor = &sensors[i];
-        clock_gettime(CLOCK_REALTIME, &ts_sensor);
-        channel_select(handle, sensor->channel);
-        switch (sensor->hw) {
-            case VEML7700:
-                res = veml7700_read(handle, &sensor->veml7700_sensor);
-                break;
-            case LTR390UV:
-                res = ltr390uv_read(handle, &sensor->ltr390uv_sensor);
-                break;
-            case MLX90614:
-                res = mlx90614_read(handle, &sensor->mlx90614_sensor);
-                break;
+    // admission control, from what each driver puts on the bus and how long the usb takes to answer
+    for (i=0; i<adapter_count; i++) {
+        adapter = &adapters[i];
+        if (adapter->active) {
+            adapter->round_trip_us = i2c_round_trip_us(adapter->handle);
         }
-        sensor->read_ns += tick_elapsed_ns(&ts_sensor);
-        sensor->pass_ns += tick_elapsed_ns(&ts_pass);
-        ts_pass.tv_sec = 0L;
-        sensor->readings++;
-        if (res < 0) {
-            //channel_select(handle, NO_CHANNEL);
-            sensor->error = "bad read";
-            sensor->errors++;
-            sensor->readings--;
+        if (adapter->round_trip_us <= 0) {
+            adapter->round_trip_us = PLAN_ROUND_TRIP_US;
+        }
+    }
+    for (i=0; sync_ms && i<adapter_count; i++) {
+        plan_sync(&adapters[i]);
+    }
+    for (i=0; i<sensors.count; i++) {
+        sensor = sensors.list[i];
+        plan_sensor(&adapters[sensor->adapter], sensor);
+    }
+    if (show_plan(&sensors) && plan_budget) {
+        printf("Not starting, remove sensors, use slower modes or raise --budget.\n");
+        close_adapters();
+        return 1;
+    }
+    for (i=0; i<adapter_count; i++) {
+        adapter = &adapters[i];
+        if (!adapter->active) {
             continue;
         }
+        adapter->sensors = &sensors;
+        tick_attach();
+        if (ring_init(&adapter->completions, sizeof(struct completion), COMPLETION_SLOTS)
+            || pthread_create(&adapter->thread, NULL, sync_ms ? acquire_sync : acquire, adapter)) {
+            tick_detach();
+            printf("Unable to start the USB thread for %s.\n", adapter->serial);
+            adapter->active = 0;
+            force_exit = 1;
+        }
+    }
 
-        if (force_exit) {
-            break;
+    pending = 0;
+    tick_real_now(&redrawn);
+    while (!force_exit) {
+        updated = 0;
+        for (i=0; i<adapter_count; i++) {
+            if (adapters[i].active) {
+                updated += drain_completions(&adapters[i], &shown);
+            }
         }
+        pending += updated;
+        tick_real_now(&now);
+        if (pending && tick_difference(&now, &redrawn) >= STATUS_REDRAW_MS) {
+            show_status(&shown);
+            pending = 0;
+            redrawn = now;
+        }
+        if (!updated) {
+            tick_sleep_us(tick_is_virtual() ? CONSUMER_VIRTUAL_SLEEP_US : CONSUMER_SLEEP_US);
+        }
+    }
 
-        clock_gettime(CLOCK_REALTIME, &ts_io_1);
-        //printf("ch: %i   lux: %.3f    unfiltered: %.3f    raw: %i    int: %ims    gain: %s\n", sensor->channel, sensor->recent_lux, sensor->recent_unf, sensor->recent_raw, veml7700_int_ms[sensor->integration], veml7700_g_str[sensor->gain]);
-        show_status(sensors);
-        maybe_log(sensor, 0);
-        //channel_select(handle, NO_CHANNEL);
-        clock_gettime(CLOCK_REALTIME, &ts_io_2);
+    // the sensors belong to this thread again once the usb threads are gone
+    // which they can't be if this one holds up the virtual clock while it waits
+    tick_detach();
+    for (i=0; i<adapter_count; i++) {
+        adapter = &adapters[i];
+        if (!adapter->active) {
+            continue;
+        }
+        pthread_join(adapter->thread, NULL);
+        drain_completions(adapter, &shown);
+        ring_free(&adapter->completions);
+        if (stats_file_name) {
+            dump_stats(adapter);
+        }
     }
+    tick_attach();
 
-    for (i=0; i<MAX_SENSORS; i++) {
-        sensor = &sensors[i];
-        if (sensor->file_name) {
+    for (i=0; i<sensors.count; i++) {
+        sensor = sensors.list[i];
+        // an offline one already logged what it had when it went
+        if (sensor->file_name && !sensor->offline) {
             maybe_log(sensor, 1);
         }
     }
 
-    channel_select(handle, NO_CHANNEL);
-    cleanup(handle);
+    for (i=0; i<adapter_count; i++) {
+        schedule_free(&adapters[i]);
+    }
+    free_sensors(&sensors);
+    free_sensors(&shown);
+    close_adapters();
     return 0;
 }
-
@@ -0,0 +1,385 @@
+// Plays a --record capture back through the unchanged driver and scheduler code.
+// It implements the hidapi calls that multilux uses, so it links in place of hidapi:
+//     make replay
+// which builds multilux-replay.  The capture is named by the MULTILUX_REPLAY environment variable:
+//     MULTILUX_REPLAY=site.cap ./multilux-replay 0-0x10-L:10:a.tsv
+//
+// Every reply comes back as soon as it is asked for, so a session runs at full speed.
+// The scheduler still sleeps on the real clock between samples.
+// Since the host side may not ask in exactly the recorded order (timing moves the scheduler around),
+// each request is matched to the next unused recorded request with the same bytes,
+// looking forward from the last match first and then back to the oldest one that was skipped,
+// and the reads that followed it in the capture are the replies.
+// A summary of how well the session matched is printed on exit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <hidapi.h>
+#include "cp2112.h"
+#include "capture.h"
+
+#define REPLAY_MAX_LINKS CP2112_MAX_LINKS
+
+struct replay_record
+{
+    long long ns;
+    int kind;
+    int link;
+    int len;
+    int result;
+    unsigned char *data;
+    int used;
+};
+
+struct hid_device_
+{
+    int link;
+    int oldest;  // first request of this link that hasn't been used
+    int expect;  // where the last matched request was, the search starts here
+    int cursor;  // where the replies to the current request start, -1 for none
+};
+
+static struct hid_api_version replay_version = {HID_API_VERSION_MAJOR, HID_API_VERSION_MINOR, HID_API_VERSION_PATCH};
+
+static unsigned char *capture_data;
+static struct replay_record *records;
+static int record_count;
+static char serials[REPLAY_MAX_LINKS][32];
+static int link_count;
+
+// how closely the session followed the capture
+static long in_order;
+static long out_of_order;
+static long unmatched;
+static long missing_reads;
+
+static int is_request(int kind)
+{
+    return kind == CAPTURE_WRITE || kind == CAPTURE_SEND_FEATURE || kind == CAPTURE_GET_FEATURE;
+}
+
+static int load(const char *path)
+{
+    FILE *f;
+    long size, pos;
+    unsigned char *h;
+    int i, n;
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "replay: can't open '%s'\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    capture_data = malloc(size > 0 ? size : 1);
+    if (capture_data == NULL || fread(capture_data, 1, size, f) != (size_t)size) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    if (size < CAPTURE_MAGIC_LEN || memcmp(capture_data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+        fprintf(stderr, "replay: '%s' is not a capture\n", path);
+        return -1;
+    }
+
+    // count, then index
+    for (n=0, pos=CAPTURE_MAGIC_LEN; pos + CAPTURE_HEADER_LEN <= size; n++) {
+        h = capture_data + pos;
+        pos += CAPTURE_HEADER_LEN + (h[10] | h[11] << 8);
+    }
+    records = calloc(n > 0 ? n : 1, sizeof(struct replay_record));
+    if (records == NULL) {
+        return -1;
+    }
+    for (record_count=0, pos=CAPTURE_MAGIC_LEN; record_count < n; record_count++) {
+        struct replay_record *r = &records[record_count];
+        h = capture_data + pos;
+        r->ns = 0;
+        for (i=7; i>=0; i--) {
+            r->ns = (r->ns << 8) | h[i];
+        }
+        r->kind = h[8];
+        r->link = h[9];
+        r->len = h[10] | h[11] << 8;
+        r->result = (int)((unsigned int)h[12] | (unsigned int)h[13] << 8 | (unsigned int)h[14] << 16 | (unsigned int)h[15] << 24);
+        r->data = h + CAPTURE_HEADER_LEN;
+        if (pos + CAPTURE_HEADER_LEN + r->len > size) {
+            break;  // cut off mid-record, the rest is lost
+        }
+        pos += CAPTURE_HEADER_LEN + r->len;
+        if (r->kind == CAPTURE_OPEN && r->link < REPLAY_MAX_LINKS) {
+            i = r->len < 31 ? r->len : 31;
+            memcpy(serials[r->link], r->data, i);
+            serials[r->link][i] = '\0';
+            if (r->link >= link_count) {
+                link_count = r->link + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int hid_init(void)
+{
+    const char *path = getenv("MULTILUX_REPLAY");
+    if (path == NULL) {
+        fprintf(stderr, "replay: set MULTILUX_REPLAY to a file made with --record\n");
+        return -1;
+    }
+    return load(path);
+}
+
+int hid_exit(void)
+{
+    if (records) {
+        fprintf(stderr, "replay: %li requests in order, %li out of order, %li not in the capture, %li reads past the capture\n",
+            in_order, out_of_order, unmatched, missing_reads);
+    }
+    free(records);
+    free(capture_data);
+    records = NULL;
+    capture_data = NULL;
+    record_count = 0;
+    return 0;
+}
+
+const struct hid_api_version *hid_version(void)
+{
+    return &replay_version;
+}
+
+const char *hid_version_str(void)
+{
+    return "replay";
+}
+
+struct hid_device_info *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    struct hid_device_info *info, *head = NULL, **tail = &head;
+    wchar_t serial[32];
+    char path[32];
+    int i;
+    if ((vendor_id && vendor_id != CP2112_VID) || (product_id && product_id != CP2112_PID)) {
+        return NULL;
+    }
+    for (i=0; i<link_count; i++) {
+        info = calloc(1, sizeof(*info));
+        snprintf(path, sizeof(path), "replay:%i", i);
+        mbstowcs(serial, serials[i], 32);
+        serial[31] = L'\0';
+        info->path = strdup(path);
+        info->vendor_id = CP2112_VID;
+        info->product_id = CP2112_PID;
+        info->serial_number = wcsdup(serial);
+        info->manufacturer_string = wcsdup(L"multilux");
+        info->product_string = wcsdup(L"replayed CP2112");
+        *tail = info;
+        tail = &info->next;
+    }
+    return head;
+}
+
+void hid_free_enumeration(struct hid_device_info *devs)
+{
+    struct hid_device_info *next;
+    while (devs) {
+        next = devs->next;
+        free(devs->path);
+        free(devs->serial_number);
+        free(devs->manufacturer_string);
+        free(devs->product_string);
+        free(devs);
+        devs = next;
+    }
+}
+
+static hid_device *open_link(int link)
+{
+    hid_device *dev;
+    if (link < 0 || link >= link_count) {
+        return NULL;
+    }
+    dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) {
+        return NULL;
+    }
+    dev->link = link;
+    dev->oldest = 0;
+    dev->expect = 0;
+    dev->cursor = -1;
+    return dev;
+}
+
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+    char serial[32];
+    int i;
+    if (vendor_id != CP2112_VID || product_id != CP2112_PID) {
+        return NULL;
+    }
+    if (serial_number == NULL) {
+        return open_link(0);
+    }
+    wcstombs(serial, serial_number, sizeof(serial));
+    serial[sizeof(serial) - 1] = '\0';
+    for (i=0; i<link_count; i++) {
+        if (!strcmp(serial, serials[i])) {
+            return open_link(i);
+        }
+    }
+    return NULL;
+}
+
+hid_device *hid_open_path(const char *path)
+{
+    int link = 0;
+    if (strncmp(path, "replay", 6)) {
+        return NULL;
+    }
+    sscanf(path, "replay:%i", &link);
+    return open_link(link);
+}
+
+void hid_close(hid_device *dev)
+{
+    free(dev);
+}
+
+const wchar_t *hid_error(hid_device *dev)
+{
+    return L"replayed CP2112";
+}
+
+int hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+    return 0;
+}
+
+static int same_request(struct replay_record *r, hid_device *dev, int kind, const unsigned char *data, int len)
+{
+    // feature fetches only send a report id so that is all that is compared
+    if (r->used || r->link != dev->link || r->kind != kind) {
+        return false;
+    }
+    if (kind == CAPTURE_GET_FEATURE) {
+        return r->data[0] == data[0];
+    }
+    return r->len == len && !memcmp(r->data, data, len);
+}
+
+static struct replay_record *match(hid_device *dev, int kind, const unsigned char *data, int len)
+{
+    struct replay_record *r;
+    int i, skipped = 0;
+    while (dev->oldest < record_count
+        && (records[dev->oldest].used || records[dev->oldest].link != dev->link || !is_request(records[dev->oldest].kind))) {
+        dev->oldest++;
+    }
+    for (i=dev->expect; i<record_count; i++) {
+        r = &records[i];
+        if (same_request(r, dev, kind, data, len)) {
+            break;
+        }
+        if (!r->used && r->link == dev->link && is_request(r->kind)) {
+            skipped = 1;
+        }
+    }
+    if (i >= record_count) {
+        skipped = 1;
+        for (i=dev->oldest; i<dev->expect && i<record_count; i++) {
+            if (same_request(&records[i], dev, kind, data, len)) {
+                break;
+            }
+        }
+        if (i >= dev->expect || i >= record_count) {
+            unmatched++;
+            dev->cursor = -1;
+            return NULL;
+        }
+    }
+    r = &records[i];
+    r->used = 1;
+    if (skipped) {
+        out_of_order++;
+    } else {
+        in_order++;
+    }
+    dev->expect = i + 1;
+    dev->cursor = i + 1;
+    return r;
+}
+
+static struct replay_record *next_reply(hid_device *dev)
+{
+    // the reads after the current request, up to the next request of the same link
+    struct replay_record *r;
+    if (dev->cursor < 0) {
+        return NULL;
+    }
+    for (; dev->cursor<record_count; dev->cursor++) {
+        r = &records[dev->cursor];
+        if (r->link != dev->link) {
+            continue;
+        }
+        if (is_request(r->kind)) {
+            break;
+        }
+        if (r->kind == CAPTURE_READ && !r->used) {
+            r->used = 1;
+            dev->cursor++;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+int hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+    struct replay_record *r = match(dev, CAPTURE_WRITE, data, (int)length);
+    return r ? r->result : (int)length;
+}
+
+int hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+    struct replay_record *r = next_reply(dev);
+    int n;
+    if (r == NULL) {
+        missing_reads++;
+        // a blocking read would never return on real hardware
+        return milliseconds < 0 ? -1 : 0;
+    }
+    n = r->len < (int)length ? r->len : (int)length;
+    memcpy(data, r->data, n);
+    return r->result;
+}
+
+int hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+    return hid_read_timeout(dev, data, length, -1);
+}
+
+int hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+    struct replay_record *r = match(dev, CAPTURE_SEND_FEATURE, data, (int)length);
+    return r ? r->result : (int)length;
+}
+
+int hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+    struct replay_record *r;
+    int n;
+    if (length < 1) {
+        return -1;
+    }
+    r = match(dev, CAPTURE_GET_FEATURE, data, 1);
+    if (r == NULL) {
+        return -1;
+    }
+    n = r->len < (int)length ? r->len : (int)length;
+    memcpy(data, r->data, n);
+    return r->result;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include "tick.h"
+#include "retry.h"
+
+const struct retry_policy default_retry_policy = {
+    RETRY_IMMEDIATE, RETRY_BACKOFF_MS, RETRY_BACKOFF_MAX_MS, RETRY_TRIP_AFTER, RETRY_OPEN_MS};
+
+void retry_init(struct retry_state *retry, const struct retry_policy *policy)
+{
+    retry->policy = *policy;
+    retry->failures = 0;
+    retry->delay_ms = policy->backoff_ms;
+    retry->open = 0;
+    retry_clear(retry);
+}
+
+int retry_parse(struct retry_policy *policy, const char *text)
+{
+    // immediate,backoff_ms,backoff_max_ms,trip_after[,open_ms]
+    // returns -1 when it doesn't make sense
+    struct retry_policy p = *policy;
+    int res;
+    res = sscanf(text, "%d,%d,%d,%d,%d", &p.immediate, &p.backoff_ms, &p.backoff_max_ms, &p.trip_after, &p.open_ms);
+    if (res < 4) {
+        return -1;
+    }
+    if (p.immediate < 0 || p.backoff_ms < 0 || p.backoff_max_ms < p.backoff_ms || p.trip_after < 0 || p.open_ms < 0) {
+        return -1;
+    }
+    *policy = p;
+    return 0;
+}
+
+int retry_attempts(struct retry_state *retry)
+{
+    // an open circuit only gets a single probe
+    if (retry->open) {
+        return 1;
+    }
+    return 1 + retry->policy.immediate;
+}
+
+int retry_again(struct retry_state *retry, int attempt)
+{
+    // call after attempt number 'attempt' (from 0) failed
+    if (attempt + 1 >= retry_attempts(retry)) {
+        return 0;
+    }
+    retry->retries++;
+    return 1;
+}
+
+void retry_success(struct retry_state *retry)
+{
+    retry->failures = 0;
+    retry->delay_ms = retry->policy.backoff_ms;
+    retry->open = 0;
+}
+
+int retry_failed(struct retry_state *retry, struct timespec *wait_until)
+{
+    // every attempt of a pass failed, reschedules the sensor
+    // returns the delay in ms
+    int delay;
+    retry->failures++;
+    if (retry->policy.trip_after && retry->failures >= retry->policy.trip_after) {
+        if (!retry->open) {
+            retry->trips++;
+        }
+        retry->open = 1;
+        delay = retry->policy.open_ms;
+    } else {
+        delay = retry->delay_ms;
+        retry->delay_ms *= 2;
+        if (retry->delay_ms > retry->policy.backoff_max_ms) {
+            retry->delay_ms = retry->policy.backoff_max_ms;
+        }
+    }
+    tick_sync_increment(wait_until, delay);
+    return delay;
+}
+
+void retry_clear(struct retry_state *retry)
+{
+    // start of a new report interval
+    retry->retries = 0;
+    retry->trips = 0;
+}
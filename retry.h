@@ -0,0 +1,46 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+#include <time.h>
+
+// what to do when a sensor read fails, shared by every driver
+// a failed read is retried right away a few times,
+// then the sensor backs off exponentially,
+// and after enough failed passes in a row the circuit opens and only an occasional probe is sent
+
+struct retry_policy
+{
+    int immediate;  // extra attempts in the same pass
+    int backoff_ms;  // delay after the first failed pass, doubled each time
+    int backoff_max_ms;
+    int trip_after;  // failed passes in a row that open the circuit, 0 never opens
+    int open_ms;  // time between probes while open
+};
+
+#define RETRY_IMMEDIATE 2
+#define RETRY_BACKOFF_MS 50
+#define RETRY_BACKOFF_MAX_MS 2000
+#define RETRY_TRIP_AFTER 8
+#define RETRY_OPEN_MS 10000
+
+extern const struct retry_policy default_retry_policy;
+
+struct retry_state
+{
+    struct retry_policy policy;
+    int failures;  // failed passes in a row
+    int delay_ms;  // next backoff
+    int open;  // circuit breaker tripped
+    int retries;  // immediate retries this interval
+    int trips;  // times the circuit opened this interval
+};
+
+void retry_init(struct retry_state *retry, const struct retry_policy *policy);
+int retry_parse(struct retry_policy *policy, const char *text);
+int retry_attempts(struct retry_state *retry);
+int retry_again(struct retry_state *retry, int attempt);
+void retry_success(struct retry_state *retry);
+int retry_failed(struct retry_state *retry, struct timespec *wait_until);
+void retry_clear(struct retry_state *retry);
+
+#endif /* RETRY_H */
@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+int ring_init(struct ring *ring, size_t size, size_t count)
+{
+    // count is rounded up to a power of 2
+    size_t n = 1;
+    while (n < count) {
+        n <<= 1;
+    }
+    ring->slots = malloc(size * n);
+    if (ring->slots == NULL) {
+        return -1;
+    }
+    ring->size = size;
+    ring->count = n;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void ring_free(struct ring *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+int ring_push(struct ring *ring, const void *item)
+{
+    // returns -1 when full, never blocks
+    size_t head, tail;
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= ring->count) {
+        return -1;
+    }
+    memcpy(ring->slots + (head & (ring->count - 1)) * ring->size, item, ring->size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+int ring_pop(struct ring *ring, void *item)
+{
+    // returns -1 when empty, never blocks
+    size_t head, tail;
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return -1;
+    }
+    memcpy(item, ring->slots + (tail & (ring->count - 1)) * ring->size, ring->size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+// single producer, single consumer and lock-free
+// items are copied in and out so any struct can go through it
+
+struct ring
+{
+    unsigned char *slots;
+    size_t size;   // bytes per item
+    size_t count;  // number of slots, a power of 2
+    atomic_size_t head;  // only written by the producer
+    atomic_size_t tail;  // only written by the consumer
+};
+
+int ring_init(struct ring *ring, size_t size, size_t count);
+void ring_free(struct ring *ring);
+int ring_push(struct ring *ring, const void *item);
+int ring_pop(struct ring *ring, void *item);
+
+#endif /* RING_H */
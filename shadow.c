@@ -0,0 +1,69 @@
+#include <string.h>
+#include <hidapi.h>
+#include "cp2112.h"
+#include "shadow.h"
+
+void shadow_invalidate(struct shadow_map *map)
+{
+    map->valid = 0;
+}
+
+int shadow_same(struct shadow_map *a, struct shadow_map *b)
+{
+    // true when both maps know the same registers to hold the same values
+    int reg;
+    if (a->valid != b->valid || (a->valid && a->generation != b->generation)) {
+        return false;
+    }
+    for (reg=0; reg<SHADOW_REGS; reg++) {
+        if ((a->valid & ((uint64_t)1 << reg)) && memcmp(a->value[reg], b->value[reg], SHADOW_WIDTH)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int shadow_matches(hid_device *handle, struct shadow_map *map, int reg, unsigned char *data, int len)
+{
+    // true when the register is known to hold data already
+    if (map->generation != i2c_generation(handle)) {
+        map->valid = 0;
+        map->generation = i2c_generation(handle);
+    }
+    if (reg < 0 || reg >= SHADOW_REGS || len < 1 || len > SHADOW_WIDTH) {
+        return false;
+    }
+    if (!(map->valid & ((uint64_t)1 << reg))) {
+        return false;
+    }
+    return !memcmp(map->value[reg], data, len);
+}
+
+int shadow_write(hid_device *handle, struct shadow_map *map, int address, int reg, unsigned char *data, int len)
+{
+    // a register write through the map, same results as i2c_write()
+    unsigned char buf[SHADOW_WIDTH + 1];
+    int res;
+    if (shadow_matches(handle, map, reg, data, len)) {
+        i2c_counters(handle)->skipped++;
+        return 0;
+    }
+    if (len < 1 || len > SHADOW_WIDTH) {
+        return -1;
+    }
+    buf[0] = reg;
+    memcpy(buf + 1, data, len);
+    res = i2c_write(handle, address, buf, len + 1);
+    if (reg < 0 || reg >= SHADOW_REGS) {
+        return res;
+    }
+    if (res != 0) {
+        // it may or may not have landed
+        shadow_invalidate(map);
+        return res;
+    }
+    // the failure check above already moved the map to the current generation
+    memcpy(map->value[reg], data, len);
+    map->valid |= (uint64_t)1 << reg;
+    return res;
+}
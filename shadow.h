@@ -0,0 +1,27 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdint.h>
+#include <hidapi.h>
+
+// what is known to be in a chip's registers, so that writes of the same value can be skipped
+// one map per device, kept in the driver's state
+// a map forgets everything when its write fails or when the CP2112 link was invalidated
+// (any failed transfer, or a multiplexer that had to be re-selected)
+
+#define SHADOW_REGS 64  // registers above this are always written
+#define SHADOW_WIDTH 2  // bytes per register
+
+struct shadow_map
+{
+    uint64_t valid;  // one bit per register
+    long generation;  // i2c_generation() of the link when the values were learned
+    unsigned char value[SHADOW_REGS][SHADOW_WIDTH];
+};
+
+void shadow_invalidate(struct shadow_map *map);
+int shadow_same(struct shadow_map *a, struct shadow_map *b);
+int shadow_matches(hid_device *handle, struct shadow_map *map, int reg, unsigned char *data, int len);
+int shadow_write(hid_device *handle, struct shadow_map *map, int address, int reg, unsigned char *data, int len);
+
+#endif /* SHADOW_H */
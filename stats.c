@@ -49,3 +49,86 @@ int stats_tsv_row(struct running_stats *stats, FILE *f)
     fprintf(f, "\t%.4f\t%.4f\t%.4f\t%.4f\t%i", stats->mean, stats->stddev, stats->min, stats->max, stats->readings);
     return 0;
 }
+
+static int latency_bucket(long us)
+{
+    int shift = 0;
+    if (us < 0) {
+        us = 0;
+    }
+    if (us < LATENCY_SUB_BUCKETS) {
+        return (int)us;
+    }
+    // keep the top LATENCY_SUB_BITS+1 bits, the leading one picks the octave
+    while ((us >> shift) >= 2 * LATENCY_SUB_BUCKETS) {
+        shift++;
+    }
+    if (shift >= LATENCY_OCTAVES) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return LATENCY_SUB_BUCKETS * (shift + 1) + (int)(us >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+static long bucket_top(int bucket)
+{
+    // highest value that lands in the bucket
+    int shift;
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    return (((long)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS + 1)) << shift) - 1;
+}
+
+void clear_latency(struct latency_histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void record_latency(struct latency_histogram *h, long us)
+{
+    h->counts[latency_bucket(us)]++;
+    h->total++;
+    h->sum_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+long latency_percentile(struct latency_histogram *h, double percent)
+{
+    // upper edge of the bucket holding the percentile, never more than the max seen
+    long seen = 0;
+    long want;
+    int i;
+    if (h->total == 0) {
+        return 0;
+    }
+    want = (long)ceil(percent / 100.0 * (double)h->total);
+    if (want < 1) {
+        want = 1;
+    }
+    for (i=0; i<LATENCY_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            break;
+        }
+    }
+    if (bucket_top(i) > h->max_us) {
+        return h->max_us;
+    }
+    return bucket_top(i);
+}
+
+int latency_summary(struct latency_histogram *h, FILE *f)
+{
+    // count, mean and the usual percentiles, all in microseconds
+    if (h->total == 0) {
+        fprintf(f, "%8i", 0);
+        return 0;
+    }
+    fprintf(f, "%8li %8li %8li %8li %8li %8li %8li", h->total, h->sum_us / h->total,
+        latency_percentile(h, 50.0), latency_percentile(h, 90.0),
+        latency_percentile(h, 99.0), latency_percentile(h, 99.9), h->max_us);
+    return 0;
+}
@@ -13,6 +13,22 @@ struct running_stats
     double stddev;
 };
 
+// log-linear latency histogram in microseconds, HDR style
+// values under LATENCY_SUB_BUCKETS are exact, above that every power of two
+// is split into LATENCY_SUB_BUCKETS steps (about 6% resolution) up to ~134 seconds (2^27 us)
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_OCTAVES 23
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS * (LATENCY_OCTAVES + 1))
+
+struct latency_histogram
+{
+    unsigned int counts[LATENCY_BUCKETS];
+    long total;
+    long sum_us;
+    long max_us;
+};
+
 //extern const char *running_stats_header;
 extern const char running_stats_header[][20];
 
@@ -20,5 +36,9 @@ int clear_stats(struct running_stats *stats);
 int update_stats(struct running_stats *stats, double value);
 int stats_tsv_header(struct running_stats *stats, FILE *f);
 int stats_tsv_row(struct running_stats *stats, FILE *f);
+void clear_latency(struct latency_histogram *h);
+void record_latency(struct latency_histogram *h, long us);
+long latency_percentile(struct latency_histogram *h, double percent);
+int latency_summary(struct latency_histogram *h, FILE *f);
 
 #endif /* STATS_H */
@@ -9,6 +9,10 @@ int tca9548a_select_channel(hid_device *handle, struct tca9548a_state *device, i
 {
     unsigned char buf[5];
     int res;
+    if (device->address < 0) {
+        // no multiplexer, only the main bus exists
+        return channel < 0 ? 0 : -1;
+    }
     if (!force && device->channel == channel) {
         return 0;
     }
@@ -17,8 +21,13 @@ int tca9548a_select_channel(hid_device *handle, struct tca9548a_state *device, i
         buf[0] = 1 << channel;
     }
     res = i2c_write(handle, device->address, buf, 1);
-    if (res < 0) {
-        return res;
+    if (res != 0) {
+        device->channel = TCA9548A_UNKNOWN;
+        return -1;
+    }
+    if (device->channel == TCA9548A_UNKNOWN) {
+        // whatever was behind it could have seen anything, forget the shadowed registers
+        i2c_invalidate(handle);
     }
     device->channel = channel;
     return 0;
@@ -34,4 +43,252 @@ int tca9548a_check(hid_device *handle, int address, int force)
     return i >= 0;
 }
 
+void tca9548a_tree_init(struct tca9548a_tree *tree)
+{
+    int i;
+    tree->mux_count = 0;
+    // the plain channel numbers are held for the first multiplexer, if there turns out to be one
+    for (i=0; i<TCA9548A_CHANNELS; i++) {
+        tree->leaves[i].mux = -1;
+        tree->leaves[i].channel = i;
+    }
+    tree->leaf_count = TCA9548A_CHANNELS;
+    tree->leaf = TCA9548A_UNKNOWN;
+    tree->switches = 0;
+}
+
+static int parent_of(struct tca9548a_tree *tree, int leaf)
+{
+    return tree->muxes[tree->leaves[leaf].mux].parent;
+}
+
+int tca9548a_exposes(struct tca9548a_tree *tree, int upper, int lower)
+{
+    // whether whatever is on leaf upper is also connected while leaf lower is selected
+    while (lower >= 0) {
+        if (lower == upper) {
+            return true;
+        }
+        lower = parent_of(tree, lower);
+    }
+    return upper == -1;
+}
+
+int tca9548a_depth(struct tca9548a_tree *tree, int leaf)
+{
+    // how many multiplexers are on the way to leaf, 0 for the main bus
+    int depth = 0;
+    for (; leaf>=0 && depth<TCA9548A_DEPTH; leaf=parent_of(tree, leaf)) {
+        depth++;
+    }
+    return depth;
+}
+
+int tca9548a_discover(hid_device *handle, struct tca9548a_tree *tree)
+{
+    // finds every multiplexer on the main bus and turns them all off
+    // cascaded ones that were left connected answer the first pass too, so a second pass sees only the main bus
+    // returns how many there are
+    struct tca9548a_state off;
+    int i, m;
+    for (i=0; tca9548a_addresses[i] != END_LIST; i++) {
+        if (tca9548a_check(handle, tca9548a_addresses[i], false)) {
+            off.address = tca9548a_addresses[i];
+            off.channel = TCA9548A_UNKNOWN;
+            tca9548a_select_channel(handle, &off, -1, false);
+        }
+    }
+    for (i=0; tca9548a_addresses[i] != END_LIST; i++) {
+        if (!tca9548a_check(handle, tca9548a_addresses[i], false)) {
+            continue;
+        }
+        m = tca9548a_add_mux(tree, -1, tca9548a_addresses[i]);
+        if (m >= 0) {
+            tree->muxes[m].channel = -1;
+        }
+    }
+    if (tree->mux_count) {
+        for (i=0; i<TCA9548A_CHANNELS; i++) {
+            tree->leaves[i].mux = 0;
+        }
+    }
+    tree->leaf = -1;
+    return tree->mux_count;
+}
+
+int tca9548a_add_mux(struct tca9548a_tree *tree, int parent, int address)
+{
+    // returns the index of the multiplexer at address on leaf parent, adding it when it is new
+    // -1 when it would answer at the same time as one that is already known or the tree is full
+    struct tca9548a_state *m;
+    int i, depth = 0;
+    for (i=0; i<tree->mux_count; i++) {
+        m = &tree->muxes[i];
+        if (m->address != address) {
+            continue;
+        }
+        if (m->parent == parent) {
+            return i;
+        }
+        if (tca9548a_exposes(tree, m->parent, parent) || tca9548a_exposes(tree, parent, m->parent)) {
+            return -1;
+        }
+    }
+    for (i=parent; i>=0; i=parent_of(tree, i)) {
+        depth++;
+    }
+    if (depth >= TCA9548A_DEPTH || tree->mux_count >= TCA9548A_MAX_MUXES) {
+        return -1;
+    }
+    m = &tree->muxes[tree->mux_count];
+    m->address = address;
+    m->channel = TCA9548A_UNKNOWN;
+    m->parent = parent;
+    return tree->mux_count++;
+}
+
+int tca9548a_add_leaf(struct tca9548a_tree *tree, int mux, int channel)
+{
+    // returns the leaf index, adding it when it is new, or -1
+    int i;
+    if (mux < 0 || mux >= tree->mux_count || channel < 0 || channel > 7) {
+        return -1;
+    }
+    for (i=0; i<tree->leaf_count; i++) {
+        if (tree->leaves[i].mux == mux && tree->leaves[i].channel == channel) {
+            return i;
+        }
+    }
+    if (tree->leaf_count >= TCA9548A_MAX_LEAVES) {
+        return -1;
+    }
+    tree->leaves[tree->leaf_count].mux = mux;
+    tree->leaves[tree->leaf_count].channel = channel;
+    return tree->leaf_count++;
+}
+
+int tca9548a_parse_path(struct tca9548a_tree *tree, char *text, char **end)
+{
+    // 0x71.3 is channel 3 of the multiplexer at 0x71, cascaded ones follow like 0x70.2.0x71.3
+    // returns the leaf and sets end to whatever follows the path, or -1
+    int leaf = -1, mux, address, channel, n;
+    char *p = text;
+    while (1) {
+        n = 0;
+        if (sscanf(p, "%x.%d%n", &address, &channel, &n) != 2 || n == 0) {
+            return -1;
+        }
+        if (!has_address(address, tca9548a_addresses)) {
+            return -1;
+        }
+        mux = tca9548a_add_mux(tree, leaf, address);
+        leaf = tca9548a_add_leaf(tree, mux, channel);
+        if (leaf < 0) {
+            return -1;
+        }
+        p += n;
+        if (*p != '.') {
+            break;
+        }
+        p++;
+    }
+    *end = p;
+    return leaf;
+}
+
+int tca9548a_select_leaf(hid_device *handle, struct tca9548a_tree *tree, int leaf)
+{
+    // connects leaf to the main bus and disconnects everything else, -1 for only the main bus
+    // each multiplexer remembers its channel so only the ones that have to change are written
+    // one that is cut off keeps its channel and gets turned off when it is connected again
+    struct tca9548a_state *m;
+    int path[TCA9548A_DEPTH];
+    int i, depth, l, parent, next, want;
+    if (leaf == tree->leaf) {
+        return 0;
+    }
+    if (leaf >= tree->leaf_count || (leaf >= 0 && tree->leaves[leaf].mux < 0)) {
+        return -1;
+    }
+    for (depth=0, l=leaf; l>=0 && depth<TCA9548A_DEPTH; l=parent_of(tree, l)) {
+        path[depth++] = l;
+    }
+    // from the main bus down, every multiplexer that is connected on the way
+    parent = -1;
+    for (; depth>=0; depth--) {
+        next = depth > 0 ? path[depth - 1] : -1;
+        for (i=0; i<tree->mux_count; i++) {
+            m = &tree->muxes[i];
+            if (m->parent != parent) {
+                continue;
+            }
+            want = -1;
+            if (next >= 0 && tree->leaves[next].mux == i) {
+                want = tree->leaves[next].channel;
+            }
+            if (m->channel == want) {
+                continue;
+            }
+            if (tca9548a_select_channel(handle, m, want, false)) {
+                tree->leaf = TCA9548A_UNKNOWN;
+                return -1;
+            }
+            tree->switches++;
+        }
+        parent = next;
+    }
+    tree->leaf = leaf;
+    return 0;
+}
+
+int tca9548a_select_mask(hid_device *handle, struct tca9548a_tree *tree, int leaf, int mask)
+{
+    // like selecting leaf, but with every channel in mask of the same multiplexer connected too
+    // only good for writes, several chips answering one read would garble it
+    struct tca9548a_state *m;
+    unsigned char buf[1];
+    if (tca9548a_select_leaf(handle, tree, leaf)) {
+        return -1;
+    }
+    m = &tree->muxes[tree->leaves[leaf].mux];
+    if (mask == 1 << m->channel) {
+        return 0;
+    }
+    buf[0] = mask & 0xFF;
+    // the next select has to walk the tree again
+    tree->leaf = TCA9548A_UNKNOWN;
+    if (i2c_write(handle, m->address, buf, 1)) {
+        m->channel = TCA9548A_UNKNOWN;
+        return -1;
+    }
+    m->channel = TCA9548A_MASK;
+    tree->switches++;
+    return 0;
+}
+
+char *tca9548a_leaf_name(struct tca9548a_tree *tree, int leaf, char name[TCA9548A_NAME])
+{
+    // * for the main bus, the channel number for the first multiplexer, otherwise the whole path
+    int path[TCA9548A_DEPTH];
+    int depth, l, n = 0;
+    struct tca9548a_leaf *f;
+    if (leaf < 0) {
+        snprintf(name, TCA9548A_NAME, "*");
+        return name;
+    }
+    if (leaf < TCA9548A_CHANNELS) {
+        snprintf(name, TCA9548A_NAME, "%i", leaf);
+        return name;
+    }
+    for (depth=0, l=leaf; l>=0 && depth<TCA9548A_DEPTH; l=parent_of(tree, l)) {
+        path[depth++] = l;
+    }
+    name[0] = '\0';
+    while (depth-- > 0 && n < TCA9548A_NAME) {
+        f = &tree->leaves[path[depth]];
+        n += snprintf(name + n, TCA9548A_NAME - n, "%s0x%X.%i", n ? "." : "", tree->muxes[f->mux].address, f->channel);
+    }
+    return name;
+}
+
 char *tca9548a_mode_help = "The TCA9548A multiplexer has no modes.";
@@ -1,16 +1,58 @@
-
 extern const int tca9548a_addresses[];
+
+// the selected channel is not known, the next select always writes
+#define TCA9548A_UNKNOWN -3
+// several channels are on at once, for writes to all of them
+#define TCA9548A_MASK -4
 extern char *tca9548a_mode_help;
 
+// every multiplexer reachable from one CP2112, on the main bus or cascaded behind another one
+#define TCA9548A_MAX_MUXES 16
+#define TCA9548A_MAX_LEAVES 64
+#define TCA9548A_DEPTH 4
+// leaves 0-7 are the channels of the first multiplexer on the main bus, the plain channel numbers
+#define TCA9548A_CHANNELS 8
+// longest leaf name, 0x70.1.0x71.2.0x72.3.0x73.4
+#define TCA9548A_NAME 32
+
 struct tca9548a_state
 {
     int address;
     int channel;
+    int parent;  // leaf it hangs off, -1 for the main bus
+};
+
+// one channel of one multiplexer
+struct tca9548a_leaf
+{
+    int mux;  // -1 when it doesn't exist
+    int channel;
+};
+
+struct tca9548a_tree
+{
+    struct tca9548a_state muxes[TCA9548A_MAX_MUXES];
+    int mux_count;
+    struct tca9548a_leaf leaves[TCA9548A_MAX_LEAVES];
+    int leaf_count;
+    int leaf;  // the one connected right now, -1 for only the main bus
+    long switches;  // select writes that went out, never reset
 };
 
 int tca9548a_select_channel(hid_device *handle, struct tca9548a_state *device, int channel, int force);
 int tca9548a_check(hid_device *handle, int address, int force);
 
+void tca9548a_tree_init(struct tca9548a_tree *tree);
+int tca9548a_discover(hid_device *handle, struct tca9548a_tree *tree);
+int tca9548a_add_mux(struct tca9548a_tree *tree, int parent, int address);
+int tca9548a_add_leaf(struct tca9548a_tree *tree, int mux, int channel);
+int tca9548a_exposes(struct tca9548a_tree *tree, int upper, int lower);
+int tca9548a_depth(struct tca9548a_tree *tree, int leaf);
+int tca9548a_parse_path(struct tca9548a_tree *tree, char *text, char **end);
+int tca9548a_select_leaf(hid_device *handle, struct tca9548a_tree *tree, int leaf);
+int tca9548a_select_mask(hid_device *handle, struct tca9548a_tree *tree, int leaf, int mask);
+char *tca9548a_leaf_name(struct tca9548a_tree *tree, int leaf, char name[TCA9548A_NAME]);
+
 // What if another chip has an address collision with this board?
 // "There is no limit to the number of bytes sent, but the last byte sent is what is in the register."
 // So in theory the transaction will complete and then it will switch to a random register.
@@ -1,10 +1,162 @@
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include "tick.h"
 
-// timespec_get() versus clock_gettime()
+// every deadline is on CLOCK_MONOTONIC so that ntp steps and slews can't bunch up or stall the sampling
+// the wall clock is only for what gets written down, through an offset that is sampled again every so often
+// tick_virtual() swaps the monotonic clock for a simulated one, for fast-forwarding through a long run
 //printf("%ld.%09ld\n", ts->tv_sec, ts->tv_nsec);
 
+static atomic_llong wall_offset_ns;  // realtime - monotonic
+static atomic_llong wall_checked_ns;  // monotonic time the offset was taken, 0 for never
+
+// the virtual clock only moves when every thread taking part is asleep, and then straight to the earliest wake up
+// so a thread that is busy holds the others where they are however long it really takes
+static atomic_int virtual_on;
+static atomic_llong virtual_ns;
+static pthread_mutex_t virtual_lock = PTHREAD_MUTEX_INITIALIZER;
+static int virtual_running;  // threads taking part that are not asleep
+
+// each sleeper gets woken on its own, a broadcast would wake every thread on every step
+struct sleeper
+{
+    long long until;  // 0 for a free slot
+    pthread_cond_t wake;
+};
+static struct sleeper sleepers[TICK_SLEEPERS];
+
+static long long as_ns(struct timespec *ts)
+{
+    return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+void tick_now(struct timespec *ts)
+{
+    long long ns;
+    if (!atomic_load(&virtual_on)) {
+        clock_gettime(TICK_CLOCK, ts);
+        return;
+    }
+    ns = atomic_load(&virtual_ns);
+    ts->tv_sec = (time_t)(ns / 1000000000LL);
+    ts->tv_nsec = (long)(ns % 1000000000LL);
+}
+
+void tick_real_now(struct timespec *ts)
+{
+    // the real clock, on the virtual one too, for what a person watches
+    clock_gettime(TICK_CLOCK, ts);
+}
+
+void tick_virtual(void)
+{
+    // call from the main thread before anything else is started
+    // it starts at the real time, with the wall clock offset of that moment for good
+    struct timespec mono, real;
+    int i;
+    if (atomic_load(&virtual_on)) {
+        return;
+    }
+    clock_gettime(TICK_CLOCK, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    atomic_store(&wall_offset_ns, as_ns(&real) - as_ns(&mono));
+    atomic_store(&wall_checked_ns, as_ns(&mono));
+    atomic_store(&virtual_ns, as_ns(&mono));
+    for (i=0; i<TICK_SLEEPERS; i++) {
+        sleepers[i].until = 0;
+        pthread_cond_init(&sleepers[i].wake, NULL);
+    }
+    virtual_running = 1;
+    atomic_store(&virtual_on, 1);
+}
+
+int tick_is_virtual(void)
+{
+    return atomic_load(&virtual_on);
+}
+
+static void virtual_advance(void)
+{
+    // everyone is asleep, so nothing happens until the earliest of them wakes up
+    // the ones that are due count as running again before they get the lock back
+    long long earliest = 0;
+    int i;
+    for (i=0; i<TICK_SLEEPERS; i++) {
+        if (sleepers[i].until && (earliest == 0 || sleepers[i].until < earliest)) {
+            earliest = sleepers[i].until;
+        }
+    }
+    if (earliest == 0) {
+        return;
+    }
+    if (earliest > atomic_load(&virtual_ns)) {
+        atomic_store(&virtual_ns, earliest);
+    }
+    for (i=0; i<TICK_SLEEPERS; i++) {
+        if (sleepers[i].until && sleepers[i].until <= earliest) {
+            sleepers[i].until = 0;
+            virtual_running++;
+            pthread_cond_signal(&sleepers[i].wake);
+        }
+    }
+}
+
+static int virtual_sleep(long long until)
+{
+    int slot;
+    pthread_mutex_lock(&virtual_lock);
+    if (until <= atomic_load(&virtual_ns)) {
+        pthread_mutex_unlock(&virtual_lock);
+        return 0;
+    }
+    for (slot=0; slot<TICK_SLEEPERS && sleepers[slot].until; slot++);
+    if (slot == TICK_SLEEPERS) {
+        pthread_mutex_unlock(&virtual_lock);
+        return -1;
+    }
+    sleepers[slot].until = until;
+    virtual_running--;
+    if (virtual_running == 0) {
+        virtual_advance();
+    }
+    // by the clock and not the slot, somebody else can have the slot by the time this one gets the lock back
+    while (atomic_load(&virtual_ns) < until) {
+        pthread_cond_wait(&sleepers[slot].wake, &virtual_lock);
+    }
+    pthread_mutex_unlock(&virtual_lock);
+    return 0;
+}
+
+void tick_attach(void)
+{
+    // one more thread takes part in the virtual clock
+    // the thread starting it calls this, so time can't move on before the new one gets going
+    if (!atomic_load(&virtual_on)) {
+        return;
+    }
+    pthread_mutex_lock(&virtual_lock);
+    virtual_running++;
+    pthread_mutex_unlock(&virtual_lock);
+}
+
+void tick_detach(void)
+{
+    // the calling thread is done with the virtual clock, or about to block on something else like a join
+    if (!atomic_load(&virtual_on)) {
+        return;
+    }
+    pthread_mutex_lock(&virtual_lock);
+    virtual_running--;
+    if (virtual_running == 0) {
+        virtual_advance();
+    }
+    pthread_mutex_unlock(&virtual_lock);
+}
+
 int tick_increment(struct timespec *ts, int ms)
 {
     ts->tv_sec += ((long)ms / 1000L);
@@ -18,7 +170,7 @@ int tick_increment(struct timespec *ts, int ms)
 
 int tick_sync_increment(struct timespec *ts, int ms)
 {
-    clock_gettime(CLOCK_REALTIME, ts);
+    tick_now(ts);
     return tick_increment(ts, ms);
 }
 
@@ -26,7 +178,7 @@ int tick_ready(struct timespec *ts)
 {
     // return true when now >= ts
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+    tick_now(&now);
     if (now.tv_sec > ts->tv_sec) {
         return true;
     }
@@ -47,19 +199,93 @@ int tick_difference(struct timespec *ts1, struct timespec *ts2)
     return (int)(s*1000) + (int)(ns/1000000L);
 }
 
+long tick_difference_us(struct timespec *ts1, struct timespec *ts2)
+{
+    // ts1 - ts2, returns us
+    time_t s = ts1->tv_sec - ts2->tv_sec;
+    long ns = ts1->tv_nsec - ts2->tv_nsec;
+    return (long)s*1000000L + ns/1000L;
+}
+
 long tick_elapsed_ns(struct timespec *ts)
 {
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+    tick_now(&now);
     time_t s = now.tv_sec - ts->tv_sec;
     long ns = now.tv_nsec - ts->tv_nsec;
     return (long)(s)*1000000000L + ns;
 }
 
-int tick_missed(struct timespec *ts)
+int tick_sleep_until(struct timespec *ts)
+{
+    // an absolute deadline doesn't drift by however long it took to get here
+    // returns early on a signal so that the caller can look at its exit flag
+    int res;
+    if (atomic_load(&virtual_on)) {
+        return virtual_sleep(as_ns(ts));
+    }
+    res = clock_nanosleep(TICK_CLOCK, TIMER_ABSTIME, ts, NULL);
+    return res == 0 || res == EINTR ? 0 : -1;
+}
+
+int tick_sleep_us(long us)
+{
+    // a relative sleep, for short waits on the hardware
+    if (atomic_load(&virtual_on)) {
+        return virtual_sleep(atomic_load(&virtual_ns) + (long long)us * 1000LL);
+    }
+    return usleep(us);
+}
+
+time_t tick_seconds(void)
+{
+    // monotonic seconds, for report intervals
+    struct timespec now;
+    tick_now(&now);
+    return now.tv_sec;
+}
+
+static long long wall_offset(void)
 {
-    // ms elapsed since ts
+    struct timespec mono, real;
+    long long m;
+    tick_now(&mono);
+    m = as_ns(&mono);
+    // the virtual clock has nothing to do with the real one after the start
+    if (atomic_load(&virtual_on)) {
+        return atomic_load(&wall_offset_ns);
+    }
+    if (atomic_load(&wall_checked_ns) == 0 || m - atomic_load(&wall_checked_ns) > TICK_WALL_CHECK_NS) {
+        clock_gettime(CLOCK_REALTIME, &real);
+        atomic_store(&wall_offset_ns, as_ns(&real) - m);
+        atomic_store(&wall_checked_ns, m);
+    }
+    return atomic_load(&wall_offset_ns);
+}
+
+long long tick_next_epoch(int period_ms, long long after, struct timespec *start)
+{
+    // the next multiple of period_ms on the wall clock after epoch 'after',
+    // so that every adapter, and every run, numbers them the same way
+    // returns its number, start gets when it begins on the monotonic clock
     struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
-    return tick_difference(&now, ts);
+    long long period = (long long)period_ms * 1000000LL;
+    long long offset = wall_offset();
+    long long epoch, ns;
+    tick_now(&now);
+    epoch = (as_ns(&now) + offset) / period + 1;
+    if (epoch <= after) {
+        epoch = after + 1;
+    }
+    ns = epoch * period - offset;
+    start->tv_sec = (time_t)(ns / 1000000000LL);
+    start->tv_nsec = (long)(ns % 1000000000LL);
+    return epoch;
+}
+
+time_t tick_wall_seconds(time_t mono)
+{
+    // the wall clock time that goes with tick_seconds()
+    long long ns = (long long)mono * 1000000000LL + wall_offset();
+    return (time_t)(ns / 1000000000LL);
 }
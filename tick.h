@@ -3,12 +3,29 @@
 
 #include <time.h>
 
+// deadlines and intervals, the wall clock is only used through tick_wall_seconds()
+#define TICK_CLOCK CLOCK_MONOTONIC
+// how often the monotonic to wall clock offset is taken again
+#define TICK_WALL_CHECK_NS 1000000000LL
+// threads that can be asleep on the virtual clock at once
+#define TICK_SLEEPERS 32
+
+void tick_now(struct timespec *ts);
 int tick_increment(struct timespec *ts, int ms);
 int tick_sync_increment(struct timespec *ts, int ms);
 int tick_ready(struct timespec *ts);
 int tick_difference(struct timespec *ts1, struct timespec *ts2);
+long tick_difference_us(struct timespec *ts1, struct timespec *ts2);
 long tick_elapsed_ns(struct timespec *ts);
-int tick_missed(struct timespec *ts);
+int tick_sleep_until(struct timespec *ts);
+time_t tick_seconds(void);
+time_t tick_wall_seconds(time_t mono);
+long long tick_next_epoch(int period_ms, long long after, struct timespec *start);
+int tick_sleep_us(long us);
+void tick_real_now(struct timespec *ts);
+void tick_virtual(void);
+int tick_is_virtual(void);
+void tick_attach(void);
+void tick_detach(void);
 
 #endif /* TICK_H */
-
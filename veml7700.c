@@ -5,6 +5,7 @@
 #include "cp2112.h"
 #include "stats.h"
 #include "tick.h"
+#include "shadow.h"
 #include "veml7700.h"
 
 #ifdef _WIN32
@@ -34,48 +35,65 @@ const int v7700_less_int[] = {ALS_IT_50ms, ALS_IT_100ms, ALS_IT_200ms, ALS_IT_40
 
 const int veml7700_addresses[] = {0x10, END_LIST};
 
-int veml7700_sleep(hid_device *handle)
+int veml7700_sleep(hid_device *handle, struct veml7700_state *sensor)
 {
-    unsigned char buf[5];
-    buf[0] = ALS_CONF;
-    buf[1] = 0x01;
-    buf[2] = 0x00;
-    return i2c_write(handle, VEML7700_ADDR, buf, 3);
+    unsigned char buf[2];
+    buf[0] = 0x01;
+    buf[1] = 0x00;
+    return shadow_write(handle, &sensor->regs, VEML7700_ADDR, ALS_CONF, buf, 2);
 }
 
 int veml7700_setup(hid_device *handle, struct veml7700_state *sensor, int force)
 {
     // whatever is calling this takes care of enable
-    unsigned char buf[5];
+    // the sensor free-runs in continuous mode, so unchanged settings need no writes at all
+    unsigned char conf[2], buf[2];
     int res, i, g;
     i = sensor->integration;
     g = sensor->gain;
+    // (why did they arrange the reserved bits so that integration is split across 2 bytes?)
+    conf[0] = ((i & 0x03) << 6);
+    conf[1] = ((i & 0x0C) >> 2) | ((g & 0x03) << 3);
+    if (force) {
+        shadow_invalidate(&sensor->regs);
+    }
+    if (shadow_matches(handle, &sensor->regs, ALS_CONF, conf, 2)) {
+        return 0;
+    }
 
-    res = veml7700_sleep(handle);
+    res = veml7700_sleep(handle, sensor);
     if (res < 0) {
         return res;
     }
 
     // make sure its not in a weird mode
-    buf[0] = VEML_POWER;
+    buf[0] = 0x00;
     buf[1] = 0x00;
-    buf[2] = 0x00;
-    if (force) {
-        res = i2c_write(handle, VEML7700_ADDR, buf, 3);
-    }
+    res = shadow_write(handle, &sensor->regs, VEML7700_ADDR, VEML_POWER, buf, 2);
     if (res < 0) {
         return res;
     }
 
     // bring it out of standby and start a conversion
-    // (why did they arrange the reserved bits so that integration is split across 2 bytes?)
-    buf[0] = ALS_CONF;
-    buf[1] = ((i & 0x03) << 6);
-    buf[2] = ((i & 0x0C) >> 2) | ((g & 0x03) << 3);
-    res = i2c_write(handle, VEML7700_ADDR, buf, 3);
-    sensor->prev_integration = i;
-    sensor->prev_gain = g;
-    return res;
+    return shadow_write(handle, &sensor->regs, VEML7700_ADDR, ALS_CONF, conf, 2);
+}
+
+int veml7700_start(hid_device *handle, struct veml7700_state *sensor)
+{
+    // for --sync, a shutdown and wake up so that a fresh conversion starts now
+    // it is ready when veml7700_tick() says, like after any other setup
+    int res;
+    res = veml7700_sleep(handle, sensor);
+    if (res < 0) {
+        return res;
+    }
+    res = veml7700_setup(handle, sensor, 0);
+    if (res < 0) {
+        return res;
+    }
+    sensor->stale = 0;
+    veml7700_tick(sensor);
+    return 0;
 }
 
 int veml7700_check(hid_device *handle, int address, int force)
@@ -100,18 +118,47 @@ int veml7700_clear_stats(struct veml7700_state *sensor)
     return 0;
 }
 
-int veml7700_tick(struct veml7700_state *sensor)
+static int period_ms(struct veml7700_state *sensor)
 {
     // extra 3 (2.5 according to datasheet) is for sensor warmup
-    tick_sync_increment(&sensor->wait_until, 3 + veml7700_int_ms[sensor->integration] * 3 / 2);
+    // in continuous mode this is always more than a whole conversion, so every read is fresh
+    return 3 + veml7700_int_ms[sensor->integration] * 3 / 2;
+}
+
+int veml7700_tick(struct veml7700_state *sensor)
+{
+    tick_sync_increment(&sensor->wait_until, period_ms(sensor));
+    return 0;
+}
+
+int veml7700_cost(struct veml7700_state *sensor, struct i2c_cost *cost)
+{
+    // one pass of veml7700_read(), the setup writes only go out when autoscaling changes something
+    if (sensor->mode=='*' || sensor->mode=='L') {
+        i2c_cost_read(cost, 2);
+    }
+    if (sensor->mode=='*' || sensor->mode=='U') {
+        i2c_cost_read(cost, 2);
+    }
+    cost->period_ms = period_ms(sensor);
     return 0;
 }
 
 int veml7700_read(hid_device *handle, struct veml7700_state *sensor)
 {
     // this chip has 2 ADCs so we can read both in 1 pass
-    int raw_lux, raw_unf, res;
-    cancel_transfer(handle);
+    int raw_lux = 0, raw_unf = 0, res;
+    i2c_recover(handle);
+    if (sensor->stale) {
+        // the data registers were already used, only the new conversion is missing
+        res = veml7700_setup(handle, sensor, 0);
+        if (res) {
+            return -1;
+        }
+        sensor->stale = 0;
+        veml7700_tick(sensor);
+        return 1;
+    }
     if (sensor->mode=='*' || sensor->mode=='L') {
         raw_lux = read_word(handle, VEML7700_ADDR, ALS_DATA, 2);
     }
@@ -119,8 +166,7 @@ int veml7700_read(hid_device *handle, struct veml7700_state *sensor)
         raw_unf = read_word(handle, VEML7700_ADDR, UNFILTERED_DATA, 2);
     }
     if (raw_lux < 0 || raw_unf < 0) {
-        tick_sync_increment(&sensor->wait_until, 1000);
-        return 1;
+        return -1;
     } else {
         compute_lux(sensor, raw_lux, raw_unf);
         update_stats(&sensor->als_stats, sensor->lux);
@@ -131,11 +177,11 @@ int veml7700_read(hid_device *handle, struct veml7700_state *sensor)
     } else {
         veml7700_autoscale(sensor, raw_unf);
     }
-    // start a new conversion
+    // restart only when autoscale changed something, otherwise conversions keep running
     res = veml7700_setup(handle, sensor, 0);
     if (res) {
-        tick_sync_increment(&sensor->wait_until, 1000);
-        return res;
+        sensor->stale = 1;
+        return -1;
     }
     veml7700_tick(sensor);
     return 0;